@@ -0,0 +1,585 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* apt-worker-bench - measure how long the apt-worker takes for its
+   most important commands.
+
+   The benchmark creates a synthetic repository and dpkg status file
+   in a scratch directory, points libapt-pkg at it via APT_CONFIG, and
+   starts the real apt-worker backend with it.  It then talks to the
+   apt-worker over its fifos, exactly like the frontend does, and
+   reports latency percentiles for each command and the peak RSS of
+   the apt-worker.
+
+   The apt-worker keeps its lock and its state and looks for the
+   catalogues and domains below the "Dir" of libapt-pkg, so all its
+   files end up in the scratch directory as well.  The benchmark
+   refuses to run with an apt-worker that doesn't do this, see
+   check_worker_root.  Such an apt-worker would already have written
+   some of its state to /var/lib/hildon-application-manager by then,
+   so run this in a throw-away environment such as scratchbox.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "apt-worker-proto.h"
+
+static gint n_packages = 1000;
+static gint n_iterations = 20;
+static gchar *apt_worker_prog = (gchar *) "./apt-worker";
+static gchar *root_dir = NULL;
+static gboolean keep_root = FALSE;
+
+static GOptionEntry entries[] = {
+  { "packages", 'n', 0, G_OPTION_ARG_INT, &n_packages,
+    "Number of packages in the repository (default 1000)", "N" },
+  { "iterations", 'i', 0, G_OPTION_ARG_INT, &n_iterations,
+    "Number of times each command is run (default 20)", "N" },
+  { "apt-worker", 'w', 0, G_OPTION_ARG_FILENAME, &apt_worker_prog,
+    "The apt-worker to run (default ./apt-worker)", "PROG" },
+  { "root", 'r', 0, G_OPTION_ARG_FILENAME, &root_dir,
+    "Directory for the synthetic repository (default: a new one in /tmp)",
+    "DIR" },
+  { "keep", 'k', 0, G_OPTION_ARG_NONE, &keep_root,
+    "Don't remove the synthetic repository at the end", NULL },
+  { NULL }
+};
+
+static void
+fail (const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start (ap, fmt);
+  fprintf (stderr, "apt-worker-bench: ");
+  vfprintf (stderr, fmt, ap);
+  fprintf (stderr, "\n");
+  va_end (ap);
+  exit (1);
+}
+
+static char *
+root_path (const char *rel)
+{
+  return g_strdup_printf ("%s/%s", root_dir, rel);
+}
+
+static void
+make_dir (const char *rel)
+{
+  char *dir = root_path (rel);
+  if (g_mkdir_with_parents (dir, 0755) < 0)
+    fail ("%s: %s", dir, strerror (errno));
+  g_free (dir);
+}
+
+static FILE *
+open_root_file (const char *rel)
+{
+  char *file = root_path (rel);
+  FILE *f = fopen (file, "w");
+  if (f == NULL)
+    fail ("%s: %s", file, strerror (errno));
+  g_free (file);
+  return f;
+}
+
+/* Generating the synthetic system.
+
+   Package bench-N has version 1.1 in the repository.  Every other
+   package has version 1.0 installed, so that there are upgrades, and
+   every tenth package depends on its predecessor, so that the
+   simulations have something to do.  All packages are user packages
+   and have a display name and an icon.
+*/
+
+static char *
+package_name (int i)
+{
+  return g_strdup_printf ("bench-%05d", i);
+}
+
+static void
+write_icon (FILE *f, int i)
+{
+  guchar data[2048];
+  gchar *base64;
+  int len;
+
+  for (unsigned int j = 0; j < sizeof (data); j++)
+    data[j] = (guchar) (i * 31 + j * 7);
+
+  base64 = g_base64_encode (data, sizeof (data));
+  len = strlen (base64);
+  fprintf (f, "Maemo-Icon-26:\n");
+  for (int j = 0; j < len; j += 72)
+    fprintf (f, " %.72s\n", base64 + j);
+  g_free (base64);
+}
+
+static void
+write_package_fields (FILE *f, int i, const char *version)
+{
+  char *name = package_name (i);
+
+  fprintf (f, "Package: %s\n", name);
+  fprintf (f, "Version: %s\n", version);
+  fprintf (f, "Architecture: all\n");
+  fprintf (f, "Section: user/utilities\n");
+  fprintf (f, "Maintainer: Bench Marker <bench@example.com>\n");
+  fprintf (f, "Installed-Size: %d\n", 100 + i % 900);
+  if (i > 0 && i % 10 == 0)
+    {
+      char *dep = package_name (i - 1);
+      fprintf (f, "Depends: %s\n", dep);
+      g_free (dep);
+    }
+  fprintf (f, "Description: Synthetic package number %d\n", i);
+  fprintf (f, " This package has been generated by apt-worker-bench.\n"
+	   " It contains nothing but is described at some length so\n"
+	   " that searching in descriptions has some work to do.\n");
+  fprintf (f, "Maemo-Display-Name: Bench Application %d\n", i);
+  write_icon (f, i);
+
+  g_free (name);
+}
+
+static void
+generate_system ()
+{
+  FILE *f;
+
+  make_dir ("repo");
+  make_dir ("etc/apt/sources.list.d");
+  make_dir ("etc/apt/preferences.d");
+  make_dir ("etc/hildon-application-manager");
+  make_dir ("usr/share/hildon-application-manager/catalogues");
+  make_dir ("usr/share/hildon-application-manager/domains");
+  make_dir ("var/lib/apt/lists/partial");
+  make_dir ("var/lib/hildon-application-manager");
+  make_dir ("var/cache/apt/archives/partial");
+  make_dir ("var/lib/dpkg/info");
+  make_dir ("var/lib/dpkg/updates");
+
+  f = open_root_file ("repo/Packages");
+  for (int i = 0; i < n_packages; i++)
+    {
+      char *name = package_name (i);
+      write_package_fields (f, i, "1.1");
+      fprintf (f, "Filename: ./%s_1.1_all.deb\n", name);
+      fprintf (f, "Size: %d\n", 10000 + i);
+      fprintf (f, "MD5sum: %032x\n", i);
+      fprintf (f, "\n");
+      g_free (name);
+    }
+  fclose (f);
+
+  f = open_root_file ("var/lib/dpkg/status");
+  for (int i = 0; i < n_packages; i += 2)
+    {
+      write_package_fields (f, i, "1.0");
+      fprintf (f, "Status: install ok installed\n");
+      fprintf (f, "\n");
+    }
+  fclose (f);
+
+  fclose (open_root_file ("var/lib/dpkg/available"));
+
+  f = open_root_file ("etc/apt/sources.list");
+  fprintf (f, "deb file://%s/repo ./\n", root_dir);
+  fclose (f);
+
+  f = open_root_file ("etc/apt/apt.conf");
+  fprintf (f, "Dir \"%s/\";\n", root_dir);
+  fprintf (f, "Dir::State \"var/lib/apt/\";\n");
+  fprintf (f, "Dir::State::status \"%s/var/lib/dpkg/status\";\n", root_dir);
+  fprintf (f, "Dir::Cache \"var/cache/apt/\";\n");
+  fprintf (f, "Dir::Etc \"etc/apt/\";\n");
+  fprintf (f, "Dir::Etc::sourcelist \"sources.list\";\n");
+  fprintf (f, "Dir::Etc::sourceparts \"sources.list.d\";\n");
+  fprintf (f, "Dir::Etc::preferencesparts \"preferences.d\";\n");
+  fprintf (f, "Debug::NoLocking \"true\";\n");
+  fclose (f);
+}
+
+/* Talking to the apt-worker.
+ */
+
+static pid_t worker_pid;
+static int to_fd, from_fd, status_fd, cancel_fd;
+static int seq = 0;
+
+static double
+now ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+must_write (int fd, const void *buf, int n)
+{
+  while (n > 0)
+    {
+      int r = write (fd, buf, n);
+      if (r < 0)
+	fail ("write: %s", strerror (errno));
+      n -= r;
+      buf = ((const char *)buf) + r;
+    }
+}
+
+/* Throw away whatever the apt-worker has sent on its status fifo.
+ */
+static void
+drain_status ()
+{
+  char buf[4096];
+
+  while (read (status_fd, buf, sizeof (buf)) > 0)
+    ;
+}
+
+/* Read N bytes from the apt-worker, draining the status fifo while
+   waiting so that the apt-worker doesn't block on it.
+*/
+static void
+must_read (void *buf, int n)
+{
+  while (n > 0)
+    {
+      struct pollfd fds[2];
+
+      fds[0].fd = from_fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = status_fd;
+      fds[1].events = POLLIN;
+
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fail ("poll: %s", strerror (errno));
+	}
+
+      if (fds[1].revents & POLLIN)
+	drain_status ();
+
+      if (fds[0].revents & (POLLIN | POLLHUP))
+	{
+	  int r = read (from_fd, buf, n);
+	  if (r < 0 && errno != EAGAIN)
+	    fail ("read: %s", strerror (errno));
+	  else if (r == 0)
+	    fail ("apt-worker closed connection");
+	  else if (r > 0)
+	    {
+	      n -= r;
+	      buf = ((char *)buf) + r;
+	    }
+	}
+    }
+}
+
+static void
+open_fifo (const char *rel, char **path)
+{
+  *path = root_path (rel);
+  unlink (*path);
+  if (mkfifo (*path, 0600) < 0)
+    fail ("%s: %s", *path, strerror (errno));
+}
+
+static double
+start_worker ()
+{
+  char *to, *from, *status, *cancel;
+  char *apt_config = root_path ("etc/apt/apt.conf");
+  double start = now ();
+
+  open_fifo ("apt-worker.to", &to);
+  open_fifo ("apt-worker.from", &from);
+  open_fifo ("apt-worker.status", &status);
+  open_fifo ("apt-worker.cancel", &cancel);
+
+  setenv ("APT_CONFIG", apt_config, 1);
+
+  worker_pid = fork ();
+  if (worker_pid < 0)
+    fail ("fork: %s", strerror (errno));
+  else if (worker_pid == 0)
+    {
+      execl (apt_worker_prog, apt_worker_prog, "backend",
+	     to, from, status, cancel, "", (char *) NULL);
+      fprintf (stderr, "%s: %s\n", apt_worker_prog, strerror (errno));
+      _exit (1);
+    }
+
+  /* Open the fifos in the same order as the frontend does.
+   */
+  from_fd = open (from, O_RDONLY);
+  status_fd = open (status, O_RDONLY | O_NONBLOCK);
+  to_fd = open (to, O_WRONLY);
+  cancel_fd = open (cancel, O_WRONLY);
+  if (from_fd < 0 || status_fd < 0 || to_fd < 0 || cancel_fd < 0)
+    fail ("can't open fifos: %s", strerror (errno));
+
+  unlink (to);
+  unlink (from);
+  unlink (status);
+  unlink (cancel);
+  g_free (to);
+  g_free (from);
+  g_free (status);
+  g_free (cancel);
+  g_free (apt_config);
+
+  return now () - start;
+}
+
+/* Send one request and wait for its response.  Return the time this
+   took, in seconds.
+*/
+static double
+call (int cmd, apt_proto_encoder *req)
+{
+  apt_request_header hdr;
+  apt_response_header res;
+  char *data;
+  double start;
+
+  hdr.cmd = cmd;
+  hdr.seq = seq++;
+  hdr.len = req ? req->get_len () : 0;
+
+  start = now ();
+
+  must_write (to_fd, &hdr, sizeof (hdr));
+  if (hdr.len > 0)
+    must_write (to_fd, req->get_buf (), hdr.len);
+
+  must_read (&res, sizeof (res));
+  data = new char[res.len];
+  must_read (data, res.len);
+
+  double elapsed = now () - start;
+
+  if (res.seq != hdr.seq || res.cmd != cmd)
+    fail ("unexpected response %d/%d", res.cmd, res.seq);
+
+  delete[] data;
+  return elapsed;
+}
+
+static long
+stop_worker ()
+{
+  apt_request_header hdr;
+  struct rusage usage;
+  int status;
+
+  hdr.cmd = APTCMD_EXIT;
+  hdr.seq = seq++;
+  hdr.len = 0;
+  must_write (to_fd, &hdr, sizeof (hdr));
+
+  if (wait4 (worker_pid, &status, 0, &usage) < 0)
+    fail ("wait4: %s", strerror (errno));
+
+  close (to_fd);
+  close (from_fd);
+  close (status_fd);
+  close (cancel_fd);
+
+  return usage.ru_maxrss;
+}
+
+/* Statistics.
+ */
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void
+report (const char *name, double *times, int n)
+{
+  qsort (times, n, sizeof (double), compare_doubles);
+
+  printf ("%-28s %5d %9.1f %9.1f %9.1f %9.1f\n",
+	  name, n,
+	  1000 * times[n / 2],
+	  1000 * times[(n * 9) / 10],
+	  1000 * times[(n * 99) / 100],
+	  1000 * times[n - 1]);
+}
+
+static void
+bench_get_package_list (const char *name, const char *pattern)
+{
+  double *times = g_new (double, n_iterations);
+  apt_proto_encoder req;
+
+  for (int i = 0; i < n_iterations; i++)
+    {
+      req.reset ();
+      req.encode_int (1);         // only_user
+      req.encode_int (0);         // only_installed
+      req.encode_int (0);         // only_available
+      req.encode_string (pattern);
+      req.encode_int (1);         // show_magic_sys
+      times[i] = call (APTCMD_GET_PACKAGE_LIST, &req);
+    }
+
+  report (name, times, n_iterations);
+  g_free (times);
+}
+
+static void
+bench_package_command (const char *name, int cmd)
+{
+  double *times = g_new (double, n_iterations);
+  apt_proto_encoder req;
+
+  for (int i = 0; i < n_iterations; i++)
+    {
+      char *package = package_name (g_random_int_range (0, n_packages));
+
+      req.reset ();
+      req.encode_string (package);
+      if (cmd == APTCMD_GET_PACKAGE_INFO)
+	req.encode_int (0);       // only_installable_info
+      times[i] = call (cmd, &req);
+
+      g_free (package);
+    }
+
+  report (name, times, n_iterations);
+  g_free (times);
+}
+
+static void
+bench_check_updates ()
+{
+  double *times = g_new (double, n_iterations);
+
+  for (int i = 0; i < n_iterations; i++)
+    times[i] = call (APTCMD_CHECK_UPDATES, NULL);
+
+  report ("CHECK_UPDATES", times, n_iterations);
+  g_free (times);
+}
+
+/* The apt-worker takes its lock before doing anything else.  When
+   that lock is not in the scratch directory, the apt-worker uses the
+   state and the catalogues of the host, and CHECK_UPDATES and even
+   GET_PACKAGE_LIST would change them.
+*/
+static void
+check_worker_root ()
+{
+  char *lock =
+    root_path ("var/lib/hildon-application-manager/apt-worker-lock");
+  bool redirected = g_file_test (lock, G_FILE_TEST_EXISTS);
+
+  g_free (lock);
+  if (!redirected)
+    fail ("%s keeps its state outside of %s, not running it",
+	  apt_worker_prog, root_dir);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  bool created_root = false;
+
+  context = g_option_context_new ("- benchmark the apt-worker");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    fail ("%s", error->message);
+  g_option_context_free (context);
+
+  if (n_packages < 1 || n_iterations < 1)
+    fail ("need at least one package and one iteration");
+
+  if (root_dir == NULL)
+    {
+      root_dir = g_strdup ("/tmp/apt-worker-bench-XXXXXX");
+      if (mkdtemp (root_dir) == NULL)
+	fail ("mkdtemp: %s", strerror (errno));
+      created_root = true;
+    }
+
+  printf ("Generating %d packages in %s\n", n_packages, root_dir);
+  generate_system ();
+
+  double startup = start_worker ();
+  double first = call (APTCMD_NOOP, NULL);
+
+  check_worker_root ();
+
+  printf ("startup %.1f ms, first NOOP %.1f ms\n\n",
+	  1000 * startup, 1000 * first);
+  printf ("%-28s %5s %9s %9s %9s %9s\n",
+	  "command (ms)", "n", "p50", "p90", "p99", "max");
+
+  bench_check_updates ();
+  bench_get_package_list ("GET_PACKAGE_LIST", NULL);
+  bench_get_package_list ("GET_PACKAGE_LIST (pattern)", "number 12");
+  bench_package_command ("GET_PACKAGE_INFO", APTCMD_GET_PACKAGE_INFO);
+  bench_package_command ("INSTALL_CHECK", APTCMD_INSTALL_CHECK);
+
+  long maxrss = stop_worker ();
+  printf ("\napt-worker peak RSS %ld kB\n", maxrss);
+
+  if (created_root && !keep_root)
+    {
+      char *cmd = g_strdup_printf ("rm -rf '%s'", root_dir);
+      if (system (cmd) != 0)
+	fprintf (stderr, "could not remove %s\n", root_dir);
+      g_free (cmd);
+    }
+
+  return 0;
+}
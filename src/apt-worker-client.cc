@@ -326,6 +326,74 @@ cancel_download (void *unused)
   cancel_apt_worker ();
 }
 
+/* During CHECK_UPDATES, the progress bar shows the sum of the
+   progress of all catalogues, and the sub-title the name of the first
+   one that is not finished yet.  The op_downloading reports are
+   ignored meanwhile, since the apt-worker might fetch the lists in
+   several runs and they only cover the current one.
+*/
+
+struct catalogue_progress_entry {
+  int already, total;
+  char *name;
+};
+
+static GArray *catalogue_progress = NULL;
+
+static void
+reset_catalogue_progress ()
+{
+  if (catalogue_progress == NULL)
+    return;
+
+  for (guint i = 0; i < catalogue_progress->len; i++)
+    g_free (g_array_index (catalogue_progress,
+			   catalogue_progress_entry, i).name);
+  g_array_free (catalogue_progress, TRUE);
+  catalogue_progress = NULL;
+}
+
+static void
+update_catalogue_progress (int index, const char *name,
+			   int already, int total)
+{
+  if (catalogue_progress == NULL)
+    catalogue_progress =
+      g_array_new (FALSE, TRUE, sizeof (catalogue_progress_entry));
+
+  if ((guint) index >= catalogue_progress->len)
+    g_array_set_size (catalogue_progress, index + 1);
+
+  catalogue_progress_entry *e =
+    &g_array_index (catalogue_progress, catalogue_progress_entry, index);
+  e->already = already;
+  e->total = total;
+  if (e->name == NULL)
+    e->name = g_strdup (name);
+
+  int sum_already = 0, sum_total = 0;
+  const char *current = NULL;
+  bool have_current = false;
+
+  for (guint i = 0; i < catalogue_progress->len; i++)
+    {
+      e = &g_array_index (catalogue_progress, catalogue_progress_entry, i);
+      sum_already += e->already;
+      sum_total += e->total;
+      if (!have_current && e->already < e->total)
+	{
+	  current = e->name;
+	  have_current = true;
+	}
+    }
+
+  if (sum_total > 0)
+    {
+      set_entertainment_fun (current, op_downloading, sum_already, sum_total);
+      set_entertainment_cancel (cancel_download, NULL);
+    }
+}
+
 static void
 apt_status_callback (int cmd, apt_proto_decoder *dec, void *unused)
 {
@@ -336,6 +404,19 @@ apt_status_callback (int cmd, apt_proto_decoder *dec, void *unused)
   int already = dec->decode_int ();
   int total = dec->decode_int ();
 
+  if (op == op_updating_catalogue)
+    {
+      int index = dec->decode_int ();
+      const char *name = dec->decode_string_in_place ();
+
+      if (!dec->corrupted () && index >= 0)
+	update_catalogue_progress (index, name, already, total);
+      return;
+    }
+
+  if (op == op_downloading && catalogue_progress)
+    return;
+
   if (total > 0)
     {
       if (op == op_downloading)
@@ -461,7 +542,24 @@ struct worker_call {
 };
 
 static worker_call *pending_calls, **pending_tail = &pending_calls;
-static worker_call *active_call;
+
+/* The calls that have been sent to the apt-worker but whose response
+   has not arrived yet, in the order they have been sent.
+
+   We pipeline our calls: as long as there are less than
+   MAX_CALLS_IN_FLIGHT active calls, and as long as their requests
+   occupy less than MAX_BYTES_IN_FLIGHT bytes, the next pending call
+   is sent right away without waiting for the responses.  The byte
+   limit is well below the capacity of the fifo so that writing a
+   request never blocks the UI, even when the apt-worker is busy.  A
+   single call is always allowed to be in flight, regardless of its
+   size.
+*/
+#define MAX_CALLS_IN_FLIGHT 8
+#define MAX_BYTES_IN_FLIGHT 4096
+
+static worker_call *active_calls, **active_tail = &active_calls;
+static int n_active_calls, n_active_bytes;
 
 static worker_call *
 get_next_pending_worker_call ()
@@ -477,6 +575,45 @@ get_next_pending_worker_call ()
   return c;
 }
 
+static int
+worker_call_size (worker_call *c)
+{
+  return sizeof (apt_request_header) + c->len;
+}
+
+static void
+add_active_worker_call (worker_call *c)
+{
+  c->next = NULL;
+  *active_tail = c;
+  active_tail = &(c->next);
+  n_active_calls += 1;
+  n_active_bytes += worker_call_size (c);
+}
+
+/* Remove the active call with sequence number SEQ from the list and
+   return it, or return NULL when there is no such call.
+*/
+static worker_call *
+remove_active_worker_call (int seq)
+{
+  for (worker_call **cp = &active_calls; *cp; cp = &((*cp)->next))
+    {
+      worker_call *c = *cp;
+      if (c->seq == seq)
+	{
+	  *cp = c->next;
+	  if (active_tail == &(c->next))
+	    active_tail = cp;
+	  c->next = NULL;
+	  n_active_calls -= 1;
+	  n_active_bytes -= worker_call_size (c);
+	  return c;
+	}
+    }
+  return NULL;
+}
+
 static void
 cancel_worker_call (worker_call *c)
 {
@@ -487,17 +624,25 @@ cancel_worker_call (worker_call *c)
   delete c;
 }
 
+static bool
+can_send_worker_call (worker_call *c)
+{
+  if (active_calls == NULL)
+    return true;
+
+  return (n_active_calls < MAX_CALLS_IN_FLIGHT
+	  && n_active_bytes + worker_call_size (c) <= MAX_BYTES_IN_FLIGHT);
+}
+
 static void
 maybe_send_one_worker_call ()
 {
   if (!apt_worker_ready)
     return;
 
-  while (active_call == NULL)
+  while (pending_calls && can_send_worker_call (pending_calls))
     {
       worker_call *c = get_next_pending_worker_call ();
-      if (c == NULL)
-        return;
 
       if (!send_apt_worker_request (c->cmd, c->seq, c->data, c->len))
         {
@@ -508,7 +653,7 @@ maybe_send_one_worker_call ()
         {
           g_free (c->data);
           c->data = NULL;
-          active_call = c;
+          add_active_worker_call (c);
         }
     }
 }
@@ -563,13 +708,13 @@ call_apt_worker (int cmd, char *data, int len,
 static void
 cancel_all_pending_worker_calls ()
 {
-  if (active_call)
+  worker_call *c;
+  while ((c = active_calls))
     {
-      cancel_worker_call (active_call);
-      active_call = NULL;
+      remove_active_worker_call (c->seq);
+      cancel_worker_call (c);
     }
 
-  worker_call *c;
   while ((c = get_next_pending_worker_call ()))
     cancel_worker_call (c);
 }
@@ -580,8 +725,7 @@ handle_one_apt_worker_response ()
   static bool running = false;
 
   static apt_response_header res;
-  static char *response_data = NULL;
-  static int response_len = 0;
+  static apt_proto_buffer *response_buffer = NULL;
   static apt_proto_decoder dec;
 
   assert (!running);
@@ -594,15 +738,19 @@ handle_one_apt_worker_response ()
       
   //printf ("got response %d/%d/%d\n", res.cmd, res.seq, res.len);
 
-  if (response_len < res.len)
+  /* The buffer can only be reused when nobody has kept strings from
+     it.
+  */
+  if (response_buffer == NULL
+      || response_buffer->ref_count > 1
+      || response_buffer->size < res.len)
     {
-      if (response_data)
-	delete[] response_data;
-      response_data = new char[res.len];
-      response_len = res.len;
+      if (response_buffer)
+	response_buffer->unref ();
+      response_buffer = new apt_proto_buffer (res.len);
     }
 
-  if (!must_read (response_data, res.len))
+  if (!must_read (response_buffer->data, res.len))
     {
       notice_apt_worker_failure ();
       return;
@@ -611,7 +759,7 @@ handle_one_apt_worker_response ()
   if (!apt_worker_ready)
     finish_apt_worker_startup ();
 
-  dec.reset (response_data, res.len);
+  dec.reset (response_buffer, res.len);
 
   if (res.cmd == APTCMD_STATUS)
     {
@@ -622,15 +770,14 @@ handle_one_apt_worker_response ()
       return;
     }
 
-  if (active_call == NULL || active_call->seq != res.seq)
+  worker_call *c = remove_active_worker_call (res.seq);
+  if (c == NULL)
     {
       fprintf (stderr, "ignoring out of sequence reply.\n");
       return;
     }
   
   running = true;
-  worker_call *c = active_call;
-  active_call = NULL;
   c->done_callback (res.cmd, &dec, c->done_data);
   delete c;
   running = false;
@@ -679,18 +826,28 @@ apt_worker_get_package_list (bool only_user,
                    callback, data);
 }
 
+static void
+apt_worker_update_cache_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  cmd_clos *clos = (cmd_clos *) data;
+
+  reset_catalogue_progress ();
+  clos->callback (cmd, dec, clos->data);
+
+  delete clos;
+}
+
 static void
 apt_worker_update_cache_cont (int cmd, apt_proto_decoder *dec, void *data)
 {
   cmd_clos *clos = (cmd_clos *) data;
 
   request.reset ();
+  reset_catalogue_progress ();
 
   call_apt_worker (APTCMD_CHECK_UPDATES,
                    request.get_buf (), request.get_len (),
-                   clos->callback, clos->data);
-
-  delete clos;
+                   apt_worker_update_cache_reply, clos);
 }
 
 void
@@ -754,6 +911,46 @@ apt_worker_get_package_info (const char *package,
                    callback, data);
 }
 
+void
+apt_worker_get_package_infos (const char **packages,
+			      bool only_installable_info,
+			      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (only_installable_info);
+  for (int i = 0; packages[i]; i++)
+    request.encode_string (packages[i]);
+  request.encode_string (NULL);
+  call_apt_worker (APTCMD_GET_PACKAGE_INFOS,
+                   request.get_buf (), request.get_len (),
+                   callback, data);
+}
+
+void
+apt_worker_get_icons (const char **packages,
+		      const char **versions,
+		      const char **hashes,
+		      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  for (int i = 0; packages[i]; i++)
+    {
+      request.encode_string (packages[i]);
+      request.encode_string (versions[i]);
+      request.encode_string (hashes[i]);
+    }
+  request.encode_string (NULL);
+  call_apt_worker (APTCMD_GET_ICONS,
+                   request.get_buf (), request.get_len (),
+                   callback, data);
+}
+
+void
+apt_worker_get_stats (apt_worker_callback *callback, void *data)
+{
+  call_apt_worker (APTCMD_GET_STATS, NULL, 0, callback, data);
+}
+
 void
 apt_worker_get_package_details (const char *package,
 				const char *version,
@@ -41,10 +41,15 @@ typedef void apt_worker_callback (int cmd,
 				  apt_proto_decoder *dec,
 				  void *callback_data);
 
-/* There can be only one non-completed request per command.  If you
-   try tp queue another request before the pending one has completed,
-   you get an error and the DONE callback will be called with a NULL
-   response data.
+/* Requests are queued and handled by the apt-worker in the order in
+   which they have been made.  Several of them can be in flight at the
+   same time; the DONE callbacks are usually called in the same order
+   as the requests have been made.  The exception are read-only
+   queries like APTCMD_GET_PACKAGE_DETAILS that are made while a long
+   operation like APTCMD_INSTALL_PACKAGE is running: they might be
+   answered before the operation has finished.  When the apt-worker
+   dies or can not be started, the DONE callbacks of all outstanding
+   requests are called with a NULL response data.
 */
 void call_apt_worker (int cmd, char *data, int len,
 		      apt_worker_callback *done,
@@ -93,6 +98,22 @@ void apt_worker_get_package_info (const char *package,
 				  apt_worker_callback *callback,
 				  void *data);
 
+/* PACKAGES is a NULL terminated array of package names.
+ */
+void apt_worker_get_package_infos (const char **packages,
+				   bool only_installable_info,
+				   apt_worker_callback *callback,
+				   void *data);
+
+/* PACKAGES is a NULL terminated array of package names, VERSIONS and
+   HASHES have the corresponding versions and icon hashes.
+ */
+void apt_worker_get_icons (const char **packages,
+			   const char **versions,
+			   const char **hashes,
+			   apt_worker_callback *callback,
+			   void *data);
+
 void apt_worker_get_package_details (const char *package,
 				     const char *version,
 				     int summary_kind,
@@ -158,6 +179,9 @@ void apt_worker_third_party_policy_check (const char *package,
 void apt_worker_autoremove (apt_worker_callback *callback,
                             void *data);
 
+void apt_worker_get_stats (apt_worker_callback *callback,
+			   void *data);
+
 void exit_apt_worker ();
 
 #endif /* !APT_WORKER_CLIENT_H */
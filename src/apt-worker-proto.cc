@@ -137,27 +137,81 @@ void
 apt_proto_encoder::encode_xexp (xexp *x)
 {
   if (x == NULL)
-    encode_string (NULL);
+    encode_int (-1);
   else
     {
-      encode_string (xexp_tag (x));
-      if (xexp_is_list (x))
-	{
-	  xexp *y;
-	  encode_int (xexp_length (x));
-	  y = xexp_first (x);
-	  while (y)
-	    {
-	      encode_xexp (y);
-	      y = xexp_rest (y);
-	    }
-	}
-      else
+      /* Tags are interned, so they can be compared as pointers.
+       */
+      GHashTable *tags = g_hash_table_new (NULL, NULL);
+      encode_xexp_1 (x, tags);
+      g_hash_table_destroy (tags);
+    }
+}
+
+void
+apt_proto_encoder::encode_xexp_1 (xexp *x, GHashTable *tags)
+{
+  const char *tag = xexp_tag (x);
+  gpointer ref;
+
+  if (g_hash_table_lookup_extended (tags, tag, NULL, &ref))
+    encode_int (GPOINTER_TO_INT (ref));
+  else
+    {
+      int n = g_hash_table_size (tags);
+      g_hash_table_insert (tags, (gpointer) tag, GINT_TO_POINTER (n));
+      encode_int (n);
+      encode_string (tag);
+    }
+
+  if (xexp_is_list (x))
+    {
+      xexp *y;
+      encode_int (xexp_length (x));
+      y = xexp_first (x);
+      while (y)
 	{
-	  encode_int (-1);
-	  encode_string (xexp_text (x));
+	  encode_xexp_1 (y, tags);
+	  y = xexp_rest (y);
 	}
     }
+  else
+    {
+      encode_int (-1);
+      encode_string (xexp_text (x));
+    }
+}
+
+apt_proto_buffer::apt_proto_buffer (int size)
+{
+  ref_count = 1;
+  this->size = size;
+  data = new char[size];
+}
+
+apt_proto_buffer::~apt_proto_buffer ()
+{
+  delete[] data;
+}
+
+void
+apt_proto_buffer::ref ()
+{
+  ref_count += 1;
+}
+
+void
+apt_proto_buffer::unref ()
+{
+  ref_count -= 1;
+  if (ref_count == 0)
+    delete this;
+}
+
+bool
+apt_proto_buffer::contains (const void *ptr)
+{
+  return (const char *)ptr >= data && (const char *)ptr < data + size;
 }
 
 apt_proto_decoder::apt_proto_decoder ()
@@ -177,12 +231,26 @@ apt_proto_decoder::~apt_proto_decoder ()
 void
 apt_proto_decoder::reset (const char *buf, int len)
 {
+  this->buffer = NULL;
   this->buf = this->ptr = buf;
   this->len = len;
   corrupted_flag = false;
   at_end_flag = (len == 0);
 }  
 
+void
+apt_proto_decoder::reset (apt_proto_buffer *buffer, int len)
+{
+  reset (buffer->data, len);
+  this->buffer = buffer;
+}
+
+apt_proto_buffer *
+apt_proto_decoder::get_buffer ()
+{
+  return buffer;
+}
+
 bool
 apt_proto_decoder::at_end ()
 {
@@ -272,25 +340,51 @@ apt_proto_decoder::decode_string_dup ()
 
 xexp *
 apt_proto_decoder::decode_xexp ()
+{
+  xexp_arena *arena = xexp_arena_new ();
+  GPtrArray *tags = g_ptr_array_new ();
+  xexp *x = decode_xexp_1 (arena, tags);
+  g_ptr_array_free (tags, TRUE);
+  xexp_arena_unref (arena);
+  return x;
+}
+
+xexp *
+apt_proto_decoder::decode_xexp_1 (xexp_arena *arena, GPtrArray *tags)
 {
   const char *tag;
-  int len;
+  int ref, len;
 
-  tag = decode_string_in_place ();
-  if (tag == NULL)
+  ref = decode_int ();
+  if (ref < 0 || ref > (int) tags->len || corrupted ())
     return NULL;
+  if (ref == (int) tags->len)
+    {
+      tag = decode_string_in_place ();
+      if (tag == NULL)
+	return NULL;
+      g_ptr_array_add (tags, (gpointer) tag);
+    }
+  else
+    tag = (const char *) g_ptr_array_index (tags, ref);
+
   len = decode_int ();
   if (len >= 0)
     {
-      xexp *x = xexp_list_new (tag);
+      xexp *x = xexp_arena_list_new (arena, tag);
       while (!corrupted () && len > 0)
 	{
-	  xexp_cons (x, decode_xexp ());
+	  xexp *y = decode_xexp_1 (arena, tags);
+	  if (y)
+	    xexp_cons (x, y);
 	  len--;
 	}
       xexp_reverse (x);
       return x;
     }
   else
-    return xexp_text_new (tag, decode_string_in_place ());
+    {
+      const char *text = decode_string_in_place ();
+      return xexp_arena_text_new (arena, tag, text? text : "");
+    }
 }
@@ -70,6 +70,10 @@ enum apt_command {
 
   APTCMD_AUTOREMOVE,
 
+  APTCMD_GET_PACKAGE_INFOS,
+  APTCMD_GET_ICONS,
+  APTCMD_GET_STATS,
+
   APTCMD_EXIT,
 
   APTCMD_MAX
@@ -102,6 +106,13 @@ enum apt_proto_result_code {
 // Encoding and decoding of data types
 //
 // All strings are in UTF-8.
+//
+// A xexp is encoded as a tag reference (int), followed by the number
+// of children (int) and the children for a list, or by -1 (int) and
+// the text (string) for a text.  A NULL xexp has a tag reference of
+// -1 and nothing else.  Tag references count the distinct tags of the
+// whole xexp in the order in which they first appear; a reference to
+// the next tag not seen so far is followed by the tag (string).
 
 struct apt_proto_encoder {
 
@@ -127,6 +138,29 @@ private:
 
   void grow (int delta);
   void encode_mem_plus_zeros (const void *, int, int);
+  void encode_xexp_1 (xexp *x, GHashTable *tags);
+};
+
+// A reference counted buffer for received data.  Strings returned
+// by decode_string_in_place point into it and stay valid for as long
+// as someone holds a reference, so they can be kept without copying
+// them.
+
+struct apt_proto_buffer {
+
+  apt_proto_buffer (int size);
+
+  void ref ();
+  void unref ();
+
+  bool contains (const void *ptr);
+
+  int ref_count;
+  int size;
+  char *data;
+
+private:
+  ~apt_proto_buffer ();
 };
 
 struct apt_proto_decoder {
@@ -136,6 +170,11 @@ struct apt_proto_decoder {
   ~apt_proto_decoder ();
   
   void reset (const char *data, int len);
+  void reset (apt_proto_buffer *buffer, int len);
+
+  // The buffer given to reset, if any.  The decoder doesn't hold a
+  // reference to it.
+  apt_proto_buffer *get_buffer ();
 
   void decode_mem (void *, int);
   int decode_int ();
@@ -148,9 +187,12 @@ struct apt_proto_decoder {
   bool corrupted ();
 
 private:
+  apt_proto_buffer *buffer;
   const char *buf, *ptr;
   int len;
   bool corrupted_flag, at_end_flag;
+
+  xexp *decode_xexp_1 (xexp_arena *arena, GPtrArray *tags);
 };
 
 // NOOP - do nothing, no parameters, no results
@@ -166,10 +208,24 @@ private:
 // - operation (int).  See enum below.
 // - already (int).    Amount of work already done.
 // - total (int).      Total amount of work to do.
+//
+// For op_updating_catalogue, the response continues with
+//
+// - catalogue (int).  The position of the catalogue in the list
+//                     returned by GET_CATALOGUES.
+// - name (string).    The name of the catalogue in the current
+//                     locale, or null.
+//
+// and ALREADY and TOTAL count the files of that catalogue that have
+// been fetched so far and that need to be fetched.  These reports
+// are sent during CHECK_UPDATES, in addition to the op_downloading
+// ones.  The lists might be fetched in several runs, and the
+// op_downloading reports start again from zero for each of them.
 
 enum apt_proto_operation {
   op_downloading,
-  op_general
+  op_general,
+  op_updating_catalogue
 };
 
 // GET_PACKAGE_LIST - get a list of packages with their names,
@@ -195,17 +251,21 @@ enum apt_proto_operation {
 // - installed_section or null (string)
 // - installed_pretty_name or null (string)
 // - installed_short_description or null (string)
-// - installed_icon or null (string).
+// - installed_icon_hash or null (string).
 // - available_version or null (string) 
 // - available_section (string)
 // - available_pretty_name or null (string)
 // - available_short_description or null (string)
-// - available_icon or null (string)
+// - available_icon_hash or null (string)
 // - flags (int)
 //
 // When the available_short_description would be identical to the
 // installed_short_description, it is set to null.  Likewise for the
 // icon.
+//
+// The icons themselves are not included; the icon hashes identify
+// them and GET_ICONS can be used to get the ones that the frontend
+// doesn't have yet.
 
 // UPDATE_PACKAGE_CACHE - recreate package cache
 //
@@ -312,6 +372,62 @@ struct apt_proto_package_info {
   int64_t remove_user_size_delta;
 };
 
+// GET_PACKAGE_INFOS - like GET_PACKAGE_INFO, but for many packages
+//                     at once.  The simulations are done one after
+//                     the other, but the work that is common to all
+//                     of them is only done once.
+//
+// Parameters:
+//
+// - only_installable_info (int).
+// - name (string)*, (NULL).       Names of the packages.
+//
+// Response:
+//
+// - info (apt_proto_package_info)*.  One for each name, in the same
+//                                    order as in the request.
+
+// GET_ICONS - get the icons of some package versions
+//
+// Parameters:
+//
+// - (name (string), version (string), hash (string))*, (NULL).
+//
+// Response:
+//
+// - icon or null (string)*.  One for each requested version, in the
+//                            same order as in the request.  The icon
+//                            is base64 encoded and null when the
+//                            version has no icon or when its icon
+//                            doesn't have the requested hash anymore.
+
+// GET_STATS - get statistics about the last requests
+//
+// The apt-worker remembers some numbers about the last 64 requests
+// that it has handled.  All times are in microseconds.
+//
+// No parameters.
+//
+// Response:
+//
+// - cache_inits (int).          Number of cache initializations since
+//                               the apt-worker has been started.
+// - cache_init_time (int64).    Time spent in them.
+// - (command (string),          Name of the command of the request,
+//                               or WARM_UP for building the cache in
+//                               the background.
+//    wall_time (int64),         Wall clock time for handling it.
+//    cpu_time (int64),          CPU time for handling it.
+//    bytes_in (int),            Size of the request.
+//    bytes_out (int),           Size of the response.
+//    records (int),             Number of package records looked up.
+//    cache_inits (int),         Number of cache initializations.
+//    cache_init_time (int64),   Time spent in them.
+//    download_time (int64),     Time spent downloading package lists.
+//    updates_file_time (int64)) Time spent writing the available
+//                               updates file.
+//   *, (null).                  Oldest request first.
+
 // GET_PACKAGE_DETAILS - get a lot of details about a specific
 //                       package.  This is intended for the "Details"
 //                       dialog, of course.
@@ -54,14 +54,22 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
 #include <errno.h>
 #include <dirent.h>
 #include <signal.h>
 #include <ftw.h>
+#include <utime.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 #include <fstream>
 
@@ -75,6 +83,7 @@
 #include <apt-pkg/acquire-item.h>
 #include <apt-pkg/cachefile.h>
 #include <apt-pkg/strutl.h>
+#include <apt-pkg/fileutl.h>
 #include <apt-pkg/sptr.h>
 #include <apt-pkg/packagemanager.h>
 #include <apt-pkg/deblistparser.h>
@@ -90,13 +99,19 @@
 #include <apt-pkg/sha1.h>
 #include <apt-pkg/sha256.h>
 
+#include <glib/garray.h>
 #include <glib/glist.h>
 #include <glib/gstring.h>
 #include <glib/gstrfuncs.h>
 #include <glib/gmem.h>
 #include <glib/gfileutils.h>
+#include <glib/gdir.h>
+#include <glib/gutils.h>
 #include <glib/gslist.h>
 #include <glib/gkeyfile.h>
+#include <glib/gchecksum.h>
+#include <glib/gthread.h>
+#include <glib/gthreadpool.h>
 
 #include "apt-worker-proto.h"
 #include "confutils.h"
@@ -166,6 +181,10 @@ static xexp *read_operation_record ();
  */
 #define RESCUE_RESULT_FILE "/var/lib/hildon-application-manager/rescue-result"
 
+/* Where we keep the snapshot of the last GET_PACKAGE_LIST response.
+ */
+#define PACKAGE_LIST_SNAPSHOT "/var/lib/hildon-application-manager/package-list.snapshot"
+
 
 /* You know what this means.
  */
@@ -242,6 +261,7 @@ xexp *domain_conf = NULL;
 domain_info *domains = NULL;
 int domains_number = 0;
 time_t domains_last_modified = -1;
+int domains_generation = 0;
 
 #define DOMAIN_INVALID  -1
 #define DOMAIN_UNSIGNED  0
@@ -263,6 +283,316 @@ file_last_modified (const char *file_name)
   return buf.st_mtime;
 }
 
+/* CONFIGURATION WATCHER
+
+   The domains, the catalogues and the APT sources are kept in
+   directories that other packages and tools can change behind our
+   back.  Instead of checking them again for every request, we ask
+   inotify to tell us when something has changed in them and keep the
+   parsed configuration around until then.
+
+   Each watch covers one directory, optionally restricted to a single
+   file in it, and invalidates a set of configuration items.  When a
+   directory can not be watched (it does not exist, for example, or
+   inotify is not available), the items that depend on it are marked
+   as 'unwatched' and we fall back to checking them the old way.
+*/
+
+#define CONFIG_DOMAINS    (1 << 0)
+#define CONFIG_CATALOGUES (1 << 1)
+#define CONFIG_SOURCES    (1 << 2)
+#define CONFIG_ALL        (CONFIG_DOMAINS | CONFIG_CATALOGUES | CONFIG_SOURCES)
+
+#define CONFIG_WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE	\
+			   | IN_MOVED_TO | IN_MOVED_FROM | IN_ATTRIB	\
+			   | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct config_watch {
+  char *dir;
+  char *name;
+  int items;
+  int wd;
+};
+
+static int config_watch_fd = -1;
+static GSList *config_watches = NULL;
+
+/* The items that have changed since they have last been read, and
+   the items that we can not watch.
+*/
+static int config_changed = CONFIG_ALL;
+static int config_unwatched = 0;
+
+static void
+add_config_watch (const char *dir, const char *name, int items)
+{
+  config_watch *w = new config_watch;
+  w->dir = g_strdup (dir);
+  w->name = g_strdup (name);
+  w->items = items;
+  w->wd = -1;
+
+  if (config_watch_fd >= 0)
+    w->wd = inotify_add_watch (config_watch_fd, dir, CONFIG_WATCH_MASK);
+
+  if (w->wd < 0)
+    {
+      DBG ("Not watching %s: %s", dir, strerror (errno));
+      config_unwatched |= items;
+    }
+
+  config_watches = g_slist_prepend (config_watches, w);
+}
+
+static void
+add_config_file_watch (const char *file, int items)
+{
+  char *dir = g_path_get_dirname (file);
+  char *name = g_path_get_basename (file);
+  add_config_watch (dir, name, items);
+  g_free (name);
+  g_free (dir);
+}
+
+static void
+init_config_watcher ()
+{
+  config_watch_fd = inotify_init ();
+  if (config_watch_fd < 0)
+    perror ("inotify_init");
+  else
+    {
+      fcntl (config_watch_fd, F_SETFL,
+	     fcntl (config_watch_fd, F_GETFL) | O_NONBLOCK);
+      fcntl (config_watch_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+  add_config_watch (config_file (PACKAGE_DOMAINS), NULL, CONFIG_DOMAINS);
+  add_config_watch (config_file (PACKAGE_CATALOGUES), NULL,
+		    CONFIG_CATALOGUES);
+  add_config_file_watch (config_file (CATALOGUE_CONF), CONFIG_CATALOGUES);
+
+  string sourceparts = _config->FindDir ("Dir::Etc::sourceparts");
+  add_config_watch (sourceparts.c_str (), NULL, CONFIG_SOURCES);
+  string sourcelist = _config->FindFile ("Dir::Etc::sourcelist");
+  add_config_file_watch (sourcelist.c_str (), CONFIG_SOURCES);
+}
+
+static config_watch *
+find_config_watch (int wd)
+{
+  for (GSList *l = config_watches; l; l = l->next)
+    {
+      config_watch *w = (config_watch *)l->data;
+      if (w->wd == wd)
+	return w;
+    }
+  return NULL;
+}
+
+/* Read all pending inotify events without blocking and record which
+   configuration items they invalidate.
+*/
+static void
+poll_config_watcher ()
+{
+  char buf[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  if (config_watch_fd < 0)
+    return;
+
+  while (true)
+    {
+      ssize_t len = read (config_watch_fd, buf, sizeof (buf));
+      if (len <= 0)
+	{
+	  if (len < 0 && errno == EINTR)
+	    continue;
+	  if (len < 0 && errno != EAGAIN)
+	    perror ("inotify");
+	  return;
+	}
+
+      for (char *p = buf; p < buf + len;)
+	{
+	  struct inotify_event *ev = (struct inotify_event *)p;
+	  p += sizeof (struct inotify_event) + ev->len;
+
+	  if (ev->mask & IN_Q_OVERFLOW)
+	    {
+	      config_changed = CONFIG_ALL;
+	      continue;
+	    }
+
+	  config_watch *w = find_config_watch (ev->wd);
+	  if (w == NULL)
+	    continue;
+
+	  if (ev->mask & IN_IGNORED)
+	    {
+	      /* The directory itself is gone.  We don't try to watch
+		 it again when it reappears.
+	      */
+	      DBG ("Lost watch on %s", w->dir);
+	      w->wd = -1;
+	      config_unwatched |= w->items;
+	      config_changed |= w->items;
+	      continue;
+	    }
+
+	  if (w->name && ev->len > 0 && strcmp (w->name, ev->name))
+	    continue;
+
+	  config_changed |= w->items;
+	}
+    }
+}
+
+/* Return true when the domains need to be read again.
+ */
+static bool
+domains_changed ()
+{
+  poll_config_watcher ();
+
+  if (config_unwatched & CONFIG_DOMAINS)
+    return (file_last_modified (config_file (PACKAGE_DOMAINS))
+	    != domains_last_modified);
+
+  return (config_changed & CONFIG_DOMAINS) != 0;
+}
+
+/* The catalogues as returned by read_catalogues, kept until one of
+   the files they are read from changes.
+*/
+static xexp *catalogues_cache = NULL;
+
+/* Return a freshly allocated copy of the current catalogues.
+ */
+static xexp *
+get_catalogues ()
+{
+  poll_config_watcher ();
+
+  if (catalogues_cache == NULL
+      || (config_changed & CONFIG_CATALOGUES)
+      || (config_unwatched & CONFIG_CATALOGUES))
+    {
+      xexp_free (catalogues_cache);
+      config_changed &= ~CONFIG_CATALOGUES;
+      catalogues_cache = read_catalogues ();
+    }
+
+  return xexp_copy (catalogues_cache);
+}
+
+static void
+update_sources_digest_1 (GChecksum *sum, const char *file)
+{
+  char *contents;
+  gsize length;
+
+  g_checksum_update (sum, (const guchar *)file, strlen (file) + 1);
+  if (g_file_get_contents (file, &contents, &length, NULL))
+    {
+      g_checksum_update (sum, (const guchar *)contents, length);
+      g_free (contents);
+    }
+}
+
+/* Return a digest of the names and contents of all the sources.list
+   files that APT reads.  The caller must g_free it.
+*/
+static char *
+compute_sources_digest ()
+{
+  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+
+  string sourcelist = _config->FindFile ("Dir::Etc::sourcelist");
+  update_sources_digest_1 (sum, sourcelist.c_str ());
+
+  string sourceparts = _config->FindDir ("Dir::Etc::sourceparts");
+  GDir *dir = g_dir_open (sourceparts.c_str (), 0, NULL);
+  if (dir)
+    {
+      GSList *names = NULL;
+      while (const char *name = g_dir_read_name (dir))
+	if (g_str_has_suffix (name, ".list"))
+	  names = g_slist_insert_sorted (names, g_strdup (name),
+					 (GCompareFunc) strcmp);
+      g_dir_close (dir);
+
+      for (GSList *l = names; l; l = l->next)
+	{
+	  char *file = g_build_filename (sourceparts.c_str (),
+					 (char *)l->data, NULL);
+	  update_sources_digest_1 (sum, file);
+	  g_free (file);
+	  g_free (l->data);
+	}
+      g_slist_free (names);
+    }
+
+  char *digest = g_strdup (g_checksum_get_string (sum));
+  g_checksum_free (sum);
+  return digest;
+}
+
+/* The digest of the sources that the current cache has been built
+   from, or NULL when there is no cache.
+*/
+static char *cache_sources_digest = NULL;
+
+static void
+remember_cache_sources_digest (bool have_cache)
+{
+  g_free (cache_sources_digest);
+  cache_sources_digest = have_cache ? compute_sources_digest () : NULL;
+}
+
+/* Called after we have changed the sources ourselves.  The commands
+   that do that rebuild the cache themselves when it is needed, such
+   as CHECK_UPDATES after downloading the lists, so our own changes
+   must not cause another rebuild before the next command.
+*/
+static void
+note_own_sources_change ()
+{
+  if (cache_sources_digest)
+    remember_cache_sources_digest (true);
+}
+
+/* Return true when the sources have been changed by someone else in
+   a way that requires the cache to be rebuilt, see
+   note_own_sources_change.  Sources that can not be watched are not
+   checked at all; the cache is only rebuilt for them when we change
+   them ourselves, as before.
+*/
+static bool
+sources_need_cache_init ()
+{
+  poll_config_watcher ();
+
+  if (!(config_changed & CONFIG_SOURCES)
+      || (config_unwatched & CONFIG_SOURCES))
+    return false;
+
+  config_changed &= ~CONFIG_SOURCES;
+
+  if (cache_sources_digest == NULL)
+    return false;
+
+  char *digest = compute_sources_digest ();
+  bool changed = strcmp (digest, cache_sources_digest) != 0;
+  g_free (digest);
+
+  if (changed)
+    DBG ("Sources have changed");
+
+  return changed;
+}
+
 static void
 read_domain_conf ()
 {
@@ -311,7 +641,19 @@ read_domain_conf ()
 
   /* Update domains number and last modified timestamp */
   domains_number = i;
-  domains_last_modified = file_last_modified (PACKAGE_DOMAINS);
+  domains_last_modified = file_last_modified (config_file (PACKAGE_DOMAINS));
+  domains_generation++;
+  config_changed &= ~CONFIG_DOMAINS;
+}
+
+static domain_t
+find_domain_by_name (const char *name)
+{
+  for (int i = 0; i < domains_number; i++)
+    if (!strcmp (domains[i].name, name))
+      return i;
+
+  return DOMAIN_INVALID;
 }
 
 static domain_t
@@ -358,6 +700,7 @@ public:
   static AptWorkerCache * GetCurrent ();
   
   bool init_cache_after_request;  
+  bool refresh_cache_after_request;
   myCacheFile *cache;
   pkgDepCache::ActionGroup *action_group;
   static AptWorkerCache *current;
@@ -369,7 +712,8 @@ AptWorkerCache *AptWorkerCache::current = 0;
 bool AptWorkerCache::global_initialized = false;
 
 AptWorkerCache::AptWorkerCache ()
-  : init_cache_after_request (false), cache (0)
+  : init_cache_after_request (false), refresh_cache_after_request (false),
+    cache (0)
 {
 }
 
@@ -411,7 +755,9 @@ typedef struct extra_info_struct
   bool autoinst : 1;
   bool related : 1;
   bool soft : 1;
+  bool dirty : 1;
   domain_t cur_domain, new_domain;
+  domain_t saved_domain;
 };
 
 class myPolicy : public pkgPolicy {
@@ -432,27 +778,126 @@ public:
   virtual pkgCache::VerIterator GetCandidateVer(pkgCache::PkgIterator Pkg);
 };
 
+/* This struct holds the Maemo specific fields of the package record
+ * of a version, already parsed.  myCacheFile includes an array of
+ * these, with an entry per version.  The entries are filled in when
+ * they are needed for the first time, see GET_VERSION_INFO.
+ */
+typedef struct version_info_struct
+{
+  bool valid : 1;
+  bool has_icon : 1;
+  bool icon_hash_valid : 1;
+  int flags;
+  int64_t required_free_space;
+  char *pretty_name;
+  char *icon_hash;
+};
+
+struct package_record;
+
 class myCacheFile : public pkgCacheFile {
 
 public:
-  bool Open (OpProgress &Progress, bool WithLock = true);
+  bool Open (OpProgress &Progress, bool WithLock = true,
+	     GArray *carried_extra_info = NULL);
 
   void load_extra_info ();
   void save_extra_info ();
 
+  bool load_extra_info_store ();
+  void load_legacy_extra_info ();
+
   extra_info_struct *extra_info;
 
+  /* Whether EXTRA_INFO is the same as what is on disk, modulo the
+     transient fields.  Only then can it be carried over to a new
+     cache instead of being loaded again, see cache_refresh.
+  */
+  bool extra_info_saved;
+
+  GArray *remember_extra_info ();
+  void restore_extra_info (GArray *carried);
+
+  /* The packages whose marks might have been changed since the last
+     CACHE_RESET, as indices into the package array of the cache.
+     Only these packages need to be reset.  When ALL_DIRTY is true,
+     we have lost track and every package needs to be reset.
+  */
+  GArray *dirty_packages;
+  bool all_dirty;
+
+  void mark_dirty (const pkgCache::PkgIterator &pkg);
+  void mark_all_dirty ();
+  void clear_dirty ();
+
+  /* The parsed package records, indexed by version ID, and the
+     package_record used to fill them.
+  */
+  version_info_struct *version_info;
+  int version_info_count;
+  package_record *version_info_rec;
+
+  void free_version_info ();
+
+  /* The index for searching in descriptions, see get_search_index.
+   */
+  guint32 *search_index;
+
+  void free_search_index ();
+
   myCacheFile ()
   {
+    search_index = NULL;
     extra_info = NULL;
+    extra_info_saved = false;
+    dirty_packages = g_array_new (FALSE, FALSE, sizeof (guint));
+    all_dirty = true;
+    version_info = NULL;
+    version_info_count = 0;
+    version_info_rec = NULL;
   }
 
   ~myCacheFile ()
   {
     delete[] extra_info;
+    g_array_free (dirty_packages, TRUE);
+    free_version_info ();
+    free_search_index ();
   }
 };
 
+void
+myCacheFile::mark_dirty (const pkgCache::PkgIterator &pkg)
+{
+  if (all_dirty || pkg.end () || extra_info[pkg->ID].dirty)
+    return;
+
+  guint index = pkg.Index ();
+  extra_info[pkg->ID].dirty = true;
+  g_array_append_val (dirty_packages, index);
+}
+
+void
+myCacheFile::mark_all_dirty ()
+{
+  all_dirty = true;
+}
+
+void
+myCacheFile::clear_dirty ()
+{
+  for (guint i = 0; i < dirty_packages->len; i++)
+    {
+      pkgCache::PkgIterator pkg (*Cache, (Cache->PkgP
+					  + g_array_index (dirty_packages,
+							   guint, i)));
+      extra_info[pkg->ID].dirty = false;
+    }
+  g_array_set_size (dirty_packages, 0);
+  all_dirty = false;
+}
+
 static void set_sources_for_get_domain (pkgSourceList *sources);
 static int get_domain (pkgIndexFile*);
 
@@ -567,7 +1012,8 @@ myPolicy::GetCandidateVer (pkgCache::PkgIterator Pkg)
 }
 
 bool
-myCacheFile::Open (OpProgress &Progress, bool WithLock)
+myCacheFile::Open (OpProgress &Progress, bool WithLock,
+		   GArray *carried_extra_info)
 {
   if (BuildCaches(Progress,WithLock) == false)
     return false;
@@ -582,7 +1028,10 @@ myCacheFile::Open (OpProgress &Progress, bool WithLock)
   
   pol->InitDomains ();
   
-  load_extra_info ();
+  if (carried_extra_info)
+    restore_extra_info (carried_extra_info);
+  else
+    load_extra_info ();
 
   // Create the dependency cache
   DCache = new pkgDepCache(Cache,Policy);
@@ -597,97 +1046,369 @@ myCacheFile::Open (OpProgress &Progress, bool WithLock)
   return true;
 }
 
-/* Save the 'extra_info' of the cache.  We first make a copy of the
-   Auto flags in our own extra_info storage so that CACHE_RESET
-   will reset the Auto flags to the state last saved with this
-   function.
+/* THE EXTRA INFO STORE
+
+   The part of the extra_info that is kept across runs, the Auto flag
+   and the current domain of each package, is stored in a single
+   binary file, EXTRA_INFO_STORE.  It consists of a header
+
+     "HAMX" (4 bytes), version (int), generation (int)
+
+   followed by records of the form
+
+     0xE1 (byte), autoinst (byte),
+     length of name (2 bytes), length of domain (2 bytes),
+     name, domain
+
+   in host byte order.  Packages that are not auto-installed and in
+   the default domain have no record.  Records are only ever appended:
+   the last record for a package wins, and a record for the default
+   state takes the package out again.  Thus, saving only has to write
+   the packages that have changed, with a single fsync.  When the file
+   has collected too many outdated records, it is compacted by writing
+   it anew.  A record that has been cut short by a crash ends the
+   file; it is dropped at the next compaction.
+
+   The generation is incremented with every save, so that cache_refresh
+   can tell whether the store has been changed behind its back.
+
+   Older versions kept this information in text files, "autoinst" and
+   one "domain.<name>" per domain.  These are read when there is no
+   store yet, and removed once the store has been written.
 */
 
-void
-myCacheFile::save_extra_info ()
-{
-  if (mkdir ("/var/lib/hildon-application-manager", 0777) < 0
-      && errno != EEXIST)
-    {
-      log_stderr ("/var/lib/hildon-application-manager: %m");
-      return;
-    }
+#define EXTRA_INFO_DIR          "/var/lib/hildon-application-manager"
+#define EXTRA_INFO_STORE        EXTRA_INFO_DIR "/extra-info"
+#define EXTRA_INFO_MAGIC        "HAMX"
+#define EXTRA_INFO_VERSION      1
+#define EXTRA_INFO_RECORD_MAGIC 0xE1
 
-  FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "w");
-  if (f)
-    {
-      pkgDepCache &cache = *DCache;
+struct extra_info_header {
+  char magic[4];
+  gint32 version;
+  guint32 generation;
+};
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-	{
-	  if (cache[pkg].Flags & pkgCache::Flag::Auto)
-	    {
-	      extra_info[pkg->ID].autoinst = true;
-	      fprintf (f, "%s\n", pkg.Name ());
-	    }
-	  else
-	    extra_info[pkg->ID].autoinst = false;
-	}
-      fflush (f);
-      fsync (fileno (f));
-      fclose (f);
-    }
+struct extra_info_record {
+  guint8 magic;
+  guint8 autoinst;
+  guint16 name_len;
+  guint16 domain_len;
+};
 
-  for (domain_t i = 0; i < domains_number; i++)
-    {
-      char *name =
-	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-			 domains[i].name);
-      
-      FILE *f = fopen (name, "w");
-      if (f)
-	{
-	  pkgDepCache &cache = *DCache;
+/* What we know about the store on disk: its generation, the number of
+   records in it, and whether it needs to be written anew because it
+   is missing, damaged, or has not been written successfully.
+*/
+static guint32 extra_info_generation = 0;
+static int extra_info_records = 0;
+static bool extra_info_store_outdated = true;
 
-	  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	       !pkg.end (); pkg++)
-	    {
-	      if (extra_info[pkg->ID].cur_domain == i)
-		fprintf (f, "%s\n", pkg.Name ());
-	    }
-	  fflush (f);
-	  fsync (fileno (f));
-	  fclose (f);
-	}
-    }
-}
+static guint32
+read_extra_info_generation ()
+{
+  extra_info_header header;
+  int fd = open (config_file (EXTRA_INFO_STORE), O_RDONLY);
 
-/* Load the 'extra_info'.  You need to call CACHE_RESET to
-   transfer the auto flag into the actual cache.  */
+  if (fd < 0)
+    return 0;
 
-void
-myCacheFile::load_extra_info ()
+  if (read (fd, &header, sizeof (header)) != sizeof (header))
+    header.generation = 0;
+
+  close (fd);
+  return header.generation;
+}
+
+static void
+append_extra_info_record (GByteArray *buf, const char *name,
+			  bool autoinst, domain_t domain)
 {
-  pkgCache &cache = *Cache;
+  const char *domain_name = (domain == DOMAIN_DEFAULT
+			     ? "" : domains[domain].name);
+  extra_info_record rec;
 
-  int package_count = cache.Head().PackageCount;
+  rec.magic = EXTRA_INFO_RECORD_MAGIC;
+  rec.autoinst = autoinst;
+  rec.name_len = strlen (name);
+  rec.domain_len = strlen (domain_name);
 
-  extra_info = new extra_info_struct[package_count];
+  g_byte_array_append (buf, (guint8 *)&rec, sizeof (rec));
+  g_byte_array_append (buf, (guint8 *)name, rec.name_len);
+  g_byte_array_append (buf, (guint8 *)domain_name, rec.domain_len);
+}
 
-  for (int i = 0; i < package_count; i++)
+static void
+remove_legacy_extra_info ()
+{
+  unlink (config_file (EXTRA_INFO_DIR "/autoinst"));
+
+  for (domain_t i = 0; i < domains_number; i++)
     {
-      extra_info[i].autoinst = false;
-      extra_info[i].cur_domain = DOMAIN_DEFAULT;
+      char *name = g_strdup_printf ("%s/domain.%s",
+				    config_file (EXTRA_INFO_DIR),
+				    domains[i].name);
+      unlink (name);
+      g_free (name);
     }
+}
 
-  FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "r");
-  if (f)
-    {
-      char *line = NULL;
-      size_t len = 0;
-      ssize_t n;
+static bool
+write_all (int fd, const void *data, size_t len)
+{
+  const char *ptr = (const char *)data;
 
-      while ((n = getline (&line, &len, f)) != -1)
+  while (len > 0)
+    {
+      ssize_t n = write (fd, ptr, len);
+      if (n < 0)
 	{
-	  if (n > 0 && line[n-1] == '\n')
-	    line[n-1] = '\0';
-
-	  pkgCache::PkgIterator pkg = cache.FindPkg (line);
+	  if (errno == EINTR)
+	    continue;
+	  return false;
+	}
+      ptr += n;
+      len -= n;
+    }
+
+  return true;
+}
+
+/* Write the complete store anew, with the N_RECORDS records in
+   RECORDS.
+*/
+static bool
+write_extra_info_store (GByteArray *records, int n_records)
+{
+  const char *tmp = config_file (EXTRA_INFO_STORE ".new");
+  extra_info_header header;
+
+  memcpy (header.magic, EXTRA_INFO_MAGIC, 4);
+  header.version = EXTRA_INFO_VERSION;
+  header.generation = extra_info_generation + 1;
+
+  int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      log_stderr ("%s: %m", tmp);
+      return false;
+    }
+
+  if (!write_all (fd, &header, sizeof (header))
+      || !write_all (fd, records->data, records->len)
+      || fsync (fd) < 0)
+    {
+      log_stderr ("%s: %m", tmp);
+      close (fd);
+      unlink (tmp);
+      return false;
+    }
+
+  close (fd);
+  if (rename (tmp, config_file (EXTRA_INFO_STORE)) < 0)
+    {
+      log_stderr ("%s: %m", config_file (EXTRA_INFO_STORE));
+      unlink (tmp);
+      return false;
+    }
+
+  extra_info_generation = header.generation;
+  extra_info_records = n_records;
+  extra_info_store_outdated = false;
+  remove_legacy_extra_info ();
+  return true;
+}
+
+/* Append CHANGES, which has N_CHANGES records, to the store.
+ */
+static bool
+append_extra_info_store (GByteArray *changes, int n_changes)
+{
+  guint32 generation = extra_info_generation + 1;
+
+  int fd = open (config_file (EXTRA_INFO_STORE), O_WRONLY);
+  if (fd < 0)
+    {
+      log_stderr ("%s: %m", config_file (EXTRA_INFO_STORE));
+      return false;
+    }
+
+  if (lseek (fd, 0, SEEK_END) < 0
+      || !write_all (fd, changes->data, changes->len)
+      || pwrite (fd, &generation, sizeof (generation),
+		 offsetof (extra_info_header, generation))
+         != sizeof (generation)
+      || fsync (fd) < 0)
+    {
+      log_stderr ("%s: %m", config_file (EXTRA_INFO_STORE));
+      close (fd);
+      return false;
+    }
+
+  close (fd);
+  extra_info_generation = generation;
+  extra_info_records += n_changes;
+  return true;
+}
+
+/* Save the 'extra_info' of the cache.  We first make a copy of the
+   Auto flags in our own extra_info storage so that CACHE_RESET
+   will reset the Auto flags to the state last saved with this
+   function.
+*/
+
+void
+myCacheFile::save_extra_info ()
+{
+  if (mkdir (config_file (EXTRA_INFO_DIR), 0777) < 0
+      && errno != EEXIST)
+    {
+      log_stderr ("%s: %m", config_file (EXTRA_INFO_DIR));
+      return;
+    }
+
+  pkgDepCache &cache = *DCache;
+  GByteArray *changes = g_byte_array_new ();
+  int n_changes = 0, n_live = 0;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      extra_info_struct *info = &extra_info[pkg->ID];
+      bool autoinst = (cache[pkg].Flags & pkgCache::Flag::Auto);
+
+      if (autoinst || info->cur_domain != DOMAIN_DEFAULT)
+	n_live++;
+
+      if (autoinst != info->autoinst
+	  || info->cur_domain != info->saved_domain)
+	{
+	  append_extra_info_record (changes, pkg.Name (),
+				    autoinst, info->cur_domain);
+	  n_changes++;
+	}
+
+      info->autoinst = autoinst;
+      info->saved_domain = info->cur_domain;
+    }
+
+  if (extra_info_store_outdated
+      || extra_info_records + n_changes > 2 * n_live + 64)
+    {
+      GByteArray *records = g_byte_array_new ();
+
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	{
+	  extra_info_struct *info = &extra_info[pkg->ID];
+	  if (info->autoinst || info->cur_domain != DOMAIN_DEFAULT)
+	    append_extra_info_record (records, pkg.Name (),
+				      info->autoinst, info->cur_domain);
+	}
+
+      write_extra_info_store (records, n_live);
+      g_byte_array_free (records, TRUE);
+    }
+  else if (n_changes > 0)
+    {
+      if (!append_extra_info_store (changes, n_changes))
+	extra_info_store_outdated = true;
+    }
+
+  g_byte_array_free (changes, TRUE);
+
+  extra_info_saved = true;
+}
+
+/* Read the store into EXTRA_INFO.  Returns false when there is no
+   usable store.
+*/
+
+bool
+myCacheFile::load_extra_info_store ()
+{
+  pkgCache &cache = *Cache;
+  gchar *contents;
+  gsize len;
+  extra_info_header header;
+
+  if (!g_file_get_contents (config_file (EXTRA_INFO_STORE),
+			    &contents, &len, NULL))
+    return false;
+
+  memcpy (&header, contents, MIN (len, sizeof (header)));
+  if (len < sizeof (header)
+      || memcmp (header.magic, EXTRA_INFO_MAGIC, 4)
+      || header.version != EXTRA_INFO_VERSION)
+    {
+      log_stderr ("%s: unknown format, ignored",
+		  config_file (EXTRA_INFO_STORE));
+      g_free (contents);
+      return false;
+    }
+
+  const char *ptr = contents + sizeof (header);
+  const char *end = contents + len;
+  int n_records = 0;
+
+  while (end - ptr >= (int) sizeof (extra_info_record))
+    {
+      extra_info_record rec;
+      memcpy (&rec, ptr, sizeof (rec));
+
+      if (rec.magic != EXTRA_INFO_RECORD_MAGIC
+	  || (end - ptr
+	      < (int) (sizeof (rec) + rec.name_len + rec.domain_len)))
+	break;
+
+      string name (ptr + sizeof (rec), rec.name_len);
+      string domain (ptr + sizeof (rec) + rec.name_len, rec.domain_len);
+      ptr += sizeof (rec) + rec.name_len + rec.domain_len;
+      n_records++;
+
+      pkgCache::PkgIterator pkg = cache.FindPkg (name);
+      if (!pkg.end ())
+	{
+	  domain_t d = DOMAIN_DEFAULT;
+	  if (!domain.empty ())
+	    {
+	      d = find_domain_by_name (domain.c_str ());
+	      if (d == DOMAIN_INVALID)
+		d = DOMAIN_DEFAULT;
+	    }
+
+	  extra_info[pkg->ID].autoinst = rec.autoinst;
+	  extra_info[pkg->ID].cur_domain = d;
+	}
+    }
+
+  extra_info_generation = header.generation;
+  extra_info_records = n_records;
+  extra_info_store_outdated = (ptr != end);
+
+  g_free (contents);
+  return true;
+}
+
+/* Read the text files of older versions into EXTRA_INFO.
+ */
+
+void
+myCacheFile::load_legacy_extra_info ()
+{
+  pkgCache &cache = *Cache;
+
+  FILE *f = fopen (config_file (EXTRA_INFO_DIR "/autoinst"), "r");
+  if (f)
+    {
+      char *line = NULL;
+      size_t len = 0;
+      ssize_t n;
+
+      while ((n = getline (&line, &len, f)) != -1)
+	{
+	  if (n > 0 && line[n-1] == '\n')
+	    line[n-1] = '\0';
+
+	  pkgCache::PkgIterator pkg = cache.FindPkg (line);
 	  if (!pkg.end ())
 	    {
 	      DBG ("auto: %s", pkg.Name ());
@@ -701,9 +1422,14 @@ myCacheFile::load_extra_info ()
 
   for (domain_t i = 0; i < domains_number; i++)
     {
-      char *name =
-	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-			 domains[i].name);
+      /* Everything is in the default domain anyway.
+       */
+      if (i == DOMAIN_DEFAULT)
+	continue;
+
+      char *name = g_strdup_printf ("%s/domain.%s",
+				    config_file (EXTRA_INFO_DIR),
+				    domains[i].name);
 
       FILE *f = fopen (name, "r");
       if (f)
@@ -731,6 +1457,115 @@ myCacheFile::load_extra_info ()
 
       g_free (name);
     }
+
+  extra_info_generation = 0;
+  extra_info_records = 0;
+  extra_info_store_outdated = true;
+}
+
+/* Load the 'extra_info'.  You need to call CACHE_RESET to
+   transfer the auto flag into the actual cache.  */
+
+void
+myCacheFile::load_extra_info ()
+{
+  pkgCache &cache = *Cache;
+
+  int package_count = cache.Head().PackageCount;
+
+  extra_info = new extra_info_struct[package_count];
+
+  for (int i = 0; i < package_count; i++)
+    {
+      extra_info[i].autoinst = false;
+      extra_info[i].dirty = false;
+      extra_info[i].cur_domain = DOMAIN_DEFAULT;
+    }
+
+  if (!load_extra_info_store ())
+    load_legacy_extra_info ();
+
+  for (int i = 0; i < package_count; i++)
+    extra_info[i].saved_domain = extra_info[i].cur_domain;
+
+  extra_info_saved = true;
+}
+
+/* When only the dpkg status has changed, the extra_info of the old
+   cache is carried over to the new one instead of being loaded from
+   disk again.  Only the packages with non-default values need to be
+   remembered, by name since the new cache might number them
+   differently.
+*/
+
+struct carried_extra_info {
+  char *name;
+  bool autoinst;
+  domain_t cur_domain;
+};
+
+GArray *
+myCacheFile::remember_extra_info ()
+{
+  pkgDepCache &cache = *DCache;
+  GArray *carried = g_array_new (FALSE, FALSE, sizeof (carried_extra_info));
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      extra_info_struct *info = &extra_info[pkg->ID];
+
+      if (info->autoinst || info->cur_domain != DOMAIN_DEFAULT)
+	{
+	  carried_extra_info c;
+	  c.name = g_strdup (pkg.Name ());
+	  c.autoinst = info->autoinst;
+	  c.cur_domain = info->cur_domain;
+	  g_array_append_val (carried, c);
+	}
+    }
+
+  return carried;
+}
+
+void
+myCacheFile::restore_extra_info (GArray *carried)
+{
+  pkgCache &cache = *Cache;
+
+  int package_count = cache.Head().PackageCount;
+
+  extra_info = new extra_info_struct[package_count];
+
+  for (int i = 0; i < package_count; i++)
+    {
+      extra_info[i].autoinst = false;
+      extra_info[i].dirty = false;
+      extra_info[i].cur_domain = DOMAIN_DEFAULT;
+    }
+
+  for (guint i = 0; i < carried->len; i++)
+    {
+      carried_extra_info *c = &g_array_index (carried, carried_extra_info, i);
+      pkgCache::PkgIterator pkg = cache.FindPkg (c->name);
+      if (!pkg.end ())
+	{
+	  extra_info[pkg->ID].autoinst = c->autoinst;
+	  extra_info[pkg->ID].cur_domain = c->cur_domain;
+	}
+    }
+
+  for (int i = 0; i < package_count; i++)
+    extra_info[i].saved_domain = extra_info[i].cur_domain;
+
+  extra_info_saved = true;
+}
+
+static void
+free_carried_extra_info (GArray *carried)
+{
+  for (guint i = 0; i < carried->len; i++)
+    g_free (g_array_index (carried, carried_extra_info, i).name);
+  g_array_free (carried, TRUE);
 }
 
 /* ALLOC_BUF and FREE_BUF can be used to manage a temporary buffer of
@@ -855,8 +1690,19 @@ ForceLock (string File, bool Errors = true)
  
    The communication with the frontend happens over four
    unidirectional fifos: requests are read from INPUT_FD and responses
-   are sent back via OUTPUT_FD.  No new request is read until the
-   response to the current one has been completely sent.
+   are sent back via OUTPUT_FD.  Requests are handled strictly one
+   after the other, in the order they arrive, and every response
+   carries the sequence number of its request.  The only exception
+   are read-only queries that arrive during a long operation; they
+   are answered right away by a separate process, see QUERY SERVICE.
+
+   The frontend is allowed to pipeline its requests: it may send new
+   requests before the responses to the previous ones have arrived.
+   To make sure that the frontend never blocks on a full INPUT_FD
+   while we are blocked on a full OUTPUT_FD, we read ahead: whenever
+   a response is about to be written, all bytes that are available on
+   INPUT_FD are first moved into the PENDING_INPUT queue.  MUST_READ
+   consumes that queue before reading from INPUT_FD again.
 
    The data read from INPUT_FD must follow the request format
    specified in <apt-worker-proto.h>.  The data written to OUTPUT_FD
@@ -882,6 +1728,66 @@ ForceLock (string File, bool Errors = true)
 
 int input_fd, output_fd, status_fd, cancel_fd;
 
+/* Bytes that have been read from INPUT_FD ahead of time but have not
+   been consumed by MUST_READ yet.  This is NULL when we are not
+   running as the backend of a frontend.
+*/
+static GByteArray *pending_input = NULL;
+
+/* While a child process answers queries during a long operation, a
+   thread reads INPUT_FD instead of the main thread, and both
+   processes take turns writing responses by locking OUTPUT_LOCK_FD.
+   See QUERY SERVICE.
+*/
+static bool is_query_child = false;
+static GThread *query_thread = NULL;
+static int output_lock_fd = -1;
+
+static void
+lock_output (bool lock)
+{
+  struct flock fl;
+
+  if (output_lock_fd < 0)
+    return;
+
+  memset (&fl, 0, sizeof (fl));
+  fl.l_type = lock ? F_WRLCK : F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  while (fcntl (output_lock_fd, F_SETLKW, &fl) < 0 && errno == EINTR)
+    ;
+}
+
+/* READ_AHEAD moves all bytes that are currently available on
+   INPUT_FD into PENDING_INPUT.  It never blocks.
+*/
+static void
+read_ahead ()
+{
+  int avail, r;
+  guint old_len;
+
+  if (pending_input == NULL
+      || query_thread != NULL
+      || ioctl (input_fd, FIONREAD, &avail) < 0
+      || avail <= 0)
+    return;
+
+  old_len = pending_input->len;
+  g_byte_array_set_size (pending_input, old_len + avail);
+  r = read (input_fd, pending_input->data + old_len, avail);
+  if (r < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+	{
+	  perror ("apt-worker read");
+	  exit (1);
+	}
+      r = 0;
+    }
+  g_byte_array_set_size (pending_input, old_len + r);
+}
+
 /* MUST_READ and MUST_WRITE read and write blocks of raw bytes from
    INPUT_FD and to OUTPUT_FD.  If they return, they have succeeded and
    read or written the whole block.
@@ -892,6 +1798,15 @@ must_read (void *buf, size_t n)
 {
   int r;
 
+  if (pending_input && pending_input->len > 0)
+    {
+      size_t m = MIN (n, pending_input->len);
+      memcpy (buf, pending_input->data, m);
+      g_byte_array_remove_range (pending_input, 0, m);
+      n -= m;
+      buf = ((char *)buf) + m;
+    }
+
   while (n > 0)
     {
       r = read (input_fd, buf, n);
@@ -903,6 +1818,8 @@ must_read (void *buf, size_t n)
       else if (r == 0)
 	{
 	  DBG ("exiting");
+	  if (is_query_child)
+	    _exit (0);
 	  exit (0);
 	}
       n -= r;
@@ -922,13 +1839,19 @@ must_write (void *buf, ssize_t n)
 
 /* This function sends a response on OUTPUT_FD with the given CMD and
    SEQ.  It either succeeds or does not return.
+
+   Before writing anything, pipelined requests are read ahead so that
+   the frontend can always get rid of them.
 */
 void
 send_response_raw (int cmd, int seq, void *response, size_t len)
 {
   apt_response_header res = { cmd, seq, len };
+  read_ahead ();
+  lock_output (true);
   must_write (&res, sizeof (res));
   must_write (response, len);
+  lock_output (false);
 }
 
 /* Fabricate and send a APTCMD_STATUS response.  Parameters OP,
@@ -969,6 +1892,27 @@ send_status (int op, int already, int total, int min_change)
     }
 }
 
+/* Send a op_updating_catalogue status report for the catalogue at
+   position INDEX, whose name is NAME.  Unlike send_status, this does
+   no rate limiting; the caller should only report changes.
+*/
+
+void
+send_catalogue_status (int index, const char *name, int already, int total)
+{
+  static apt_proto_encoder status_response;
+
+  status_response.reset ();
+  status_response.encode_int (op_updating_catalogue);
+  status_response.encode_int (already);
+  status_response.encode_int (total);
+  status_response.encode_int (index);
+  status_response.encode_string (name);
+  send_response_raw (APTCMD_STATUS, -1,
+		     status_response.get_buf (),
+		     status_response.get_len ());
+}
+
 
 /** STARTUP AND COMMAND DISPATCHER.
  */
@@ -987,6 +1931,9 @@ apt_proto_encoder response;
 
 void cmd_get_package_list ();
 void cmd_get_package_info ();
+void cmd_get_package_infos ();
+void cmd_get_icons ();
+void cmd_get_stats ();
 void cmd_get_package_details ();
 int cmd_check_updates (bool with_status = true);
 void cmd_get_catalogues ();
@@ -1049,28 +1996,152 @@ static xexp *map_catalogue_error_details (xexp *x);
 */
 
 void cache_init (bool with_status = true);
+void cache_refresh ();
+
+static void start_warm_up ();
+static void finish_warm_up ();
+static bool warming_up ();
+
+static void start_query_service ();
+static void stop_query_service ();
+
+static void remember_package_list_snapshot_key (bool valid);
 
 void
 need_cache_init ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   awc->init_cache_after_request = true;
+  awc->refresh_cache_after_request = false;
 }
 
-#ifdef DEBUG_COMMANDS
-static const char *cmd_names[] = {
-  "NOOP",
-  "STATUS",
-  "GET_PACKAGE_LIST",
-  "GET_PACKAGE_INFO",
-  "GET_PACKAGE_DETAILS",
-  "CHECK_UPDATES",
-  "GET_CATALOGUES",
-  "SET_CATALOGUES",
-  "ADD_TEMP_CATALOGUES",
-  "RM_TEMP_CATALOGUES",
-  "GET_FREE_SPACE",
+/* Like need_cache_init, but for when only the dpkg status has
+   changed, such as after installing or removing packages.  See
+   cache_refresh.
+*/
+void
+need_cache_refresh ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (!awc->init_cache_after_request)
+    awc->refresh_cache_after_request = true;
+  awc->init_cache_after_request = true;
+}
+
+/* STATISTICS
+
+   We keep some numbers about the last STATS_RING_SIZE requests so
+   that we can find out where the time goes on a real device: was a
+   slow CHECK_UPDATES spent in the network, in rebuilding the cache,
+   or in writing the available updates file?  The numbers can be
+   retrieved with APTCMD_GET_STATS.
+
+   CURRENT_STATS collects the numbers for the request that is being
+   handled right now.  The warm-up thread collects its numbers in
+   WARM_UP_STATS, which are put into the ring as an entry of their own
+   when it has finished, see finish_warm_up.  Other cache
+   initializations that happen outside of any request only show up in
+   the totals.
+*/
+
+#define STATS_RING_SIZE 64
+
+/* The command of the entries for the warm-up.
+ */
+#define STATS_CMD_WARM_UP -1
+
+struct request_stats {
+  int cmd;
+  int64_t wall_usecs;
+  int64_t cpu_usecs;
+  int bytes_in;
+  int bytes_out;
+  int records_looked_up;
+  int cache_inits;
+  int64_t cache_init_usecs;
+  int64_t download_usecs;
+  int64_t updates_file_usecs;
+};
+
+static request_stats stats_ring[STATS_RING_SIZE];
+static int stats_ring_next = 0;
+static int stats_ring_count = 0;
+
+static request_stats current_stats;
+
+/* The warm-up thread has its own numbers, see thread_stats.  They
+   must only be looked at after the thread has finished.
+ */
+static request_stats warm_up_stats;
+static GStaticPrivate in_warm_up_thread = G_STATIC_PRIVATE_INIT;
+
+static request_stats *
+thread_stats ()
+{
+  if (g_static_private_get (&in_warm_up_thread))
+    return &warm_up_stats;
+  return &current_stats;
+}
+
+static int total_cache_inits = 0;
+static int64_t total_cache_init_usecs = 0;
+
+static int64_t
+wall_usecs ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * (int64_t)1000000 + tv.tv_usec;
+}
+
+static int64_t
+cpu_usecs ()
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return ((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * (int64_t)1000000
+	  + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+/* Like cpu_usecs, but only for the calling thread.  This is zero
+   when the system can't tell.
+*/
+static int64_t
+thread_cpu_usecs ()
+{
+#ifdef RUSAGE_THREAD
+  struct rusage usage;
+  getrusage (RUSAGE_THREAD, &usage);
+  return ((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * (int64_t)1000000
+	  + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#else
+  return 0;
+#endif
+}
+
+static void
+remember_request_stats (const request_stats *st)
+{
+  stats_ring[stats_ring_next] = *st;
+  stats_ring_next = (stats_ring_next + 1) % STATS_RING_SIZE;
+  if (stats_ring_count < STATS_RING_SIZE)
+    stats_ring_count++;
+}
+
+static const char *cmd_names[] = {
+  "NOOP",
+  "STATUS",
+  "GET_PACKAGE_LIST",
+  "GET_PACKAGE_INFO",
+  "GET_PACKAGE_DETAILS",
+  "CHECK_UPDATES",
+  "GET_CATALOGUES",
+  "SET_CATALOGUES",
+  "ADD_TEMP_CATALOGUES",
+  "RM_TEMP_CATALOGUES",
+  "GET_FREE_SPACE",
   "INSTALL_CHECK",
+  "DOWNLOAD_PACKAGE",
   "INSTALL_PACKAGE",
   "REMOVE_CHECK",
   "REMOVE_PACKAGE",
@@ -1079,13 +2150,35 @@ static const char *cmd_names[] = {
   "CLEAN",
   "SAVE_BACKUP_DATA",
   "GET_SYSTEM_UPDATE_PACKAGES",
-  "FLASH_AND_REBOOT",
+  "REBOOT",
   "SET_OPTIONS",
   "SET_ENV",
   "THIRD_PARTY_POLICY_CHECK",
-  "AUTOREMOVE"
+  "AUTOREMOVE",
+  "GET_PACKAGE_INFOS",
+  "GET_ICONS",
+  "GET_STATS"
 };
-#endif
+
+/* Whether the command CMD needs the cache, or anything else that
+   the warm-up thread might be using.  See WARMING UP.
+*/
+static bool
+command_needs_cache (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_NOOP:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+    case APTCMD_SET_OPTIONS:
+    case APTCMD_GET_STATS:
+      return false;
+
+    default:
+      return true;
+    }
+}
 
 void
 handle_request ()
@@ -1094,10 +2187,16 @@ handle_request ()
   char stack_reqbuf[FIXED_REQUEST_BUF_SIZE];
   char *reqbuf;
   AptWorkerCache * awc = 0;
-  time_t last_modified = -1;
+  int64_t start_wall, start_cpu;
 
   must_read (&req, sizeof (req));
 
+  start_wall = wall_usecs ();
+  start_cpu = cpu_usecs ();
+  memset (&current_stats, 0, sizeof (current_stats));
+  current_stats.cmd = req.cmd;
+  current_stats.bytes_in = req.len;
+
 #ifdef DEBUG_COMMANDS
   DBG ("got req %s/%d/%d", cmd_names[req.cmd], req.seq, req.len);
 #endif
@@ -1112,11 +2211,28 @@ handle_request ()
 
   awc = AptWorkerCache::GetCurrent ();
   awc->init_cache_after_request = false; // let's reset it now
+  awc->refresh_cache_after_request = false;
+
+  if (command_needs_cache (req.cmd))
+    {
+      finish_warm_up ();
+
+      /* Rebuild the cache when someone else has changed the sources
+	 since it was built.
+      */
+      if (sources_need_cache_init ())
+	cache_init (false);
+    }
 
   /* Re-read domains conf file if modified */
-  last_modified = file_last_modified (PACKAGE_DOMAINS);
-  if (last_modified != domains_last_modified)
-    read_domain_conf ();
+  if (domains_changed ())
+    {
+      finish_warm_up ();
+      read_domain_conf ();
+    }
+
+  if (command_is_long (req.cmd))
+    start_query_service ();
 
   switch (req.cmd)
     {
@@ -1221,6 +2337,18 @@ handle_request ()
       cmd_autoremove ();
       break;
 
+    case APTCMD_GET_PACKAGE_INFOS:
+      cmd_get_package_infos ();
+      break;
+
+    case APTCMD_GET_ICONS:
+      cmd_get_icons ();
+      break;
+
+    case APTCMD_GET_STATS:
+      cmd_get_stats ();
+      break;
+
     case APTCMD_EXIT:
       exit(0);
       break;
@@ -1230,10 +2358,14 @@ handle_request ()
       break;
     }
 
-  _error->DumpErrors ();
+  stop_query_service ();
+
+  if (!warming_up ())
+    _error->DumpErrors ();
 
   send_response_raw (req.cmd, req.seq,
 		     response.get_buf (), response.get_len ());
+  current_stats.bytes_out = response.get_len ();
 
 #ifdef DEBUG_COMMANDS
   DBG ("sent resp %s/%d/%d",
@@ -1244,9 +2376,18 @@ handle_request ()
 
   if (awc->init_cache_after_request)
     {
-      cache_init (false);
-      _error->DumpErrors ();
+      if (awc->refresh_cache_after_request)
+	{
+	  cache_refresh ();
+	  _error->DumpErrors ();
+	}
+      else
+	start_warm_up ();
     }
+
+  current_stats.wall_usecs = wall_usecs () - start_wall;
+  current_stats.cpu_usecs = cpu_usecs () - start_cpu;
+  remember_request_stats (&current_stats);
 }
 
 static int index_trust_level_for_package (pkgIndexFile *index,
@@ -1346,7 +2487,7 @@ get_apt_worker_lock (bool weak)
   while (true)
     {
       g_free (his);
-      his = try_lock (APT_WORKER_LOCK, mine);
+      his = try_lock (config_file (APT_WORKER_LOCK), mine);
       
       if (his)
 	{
@@ -1387,7 +2528,7 @@ get_apt_worker_lock (bool weak)
 	       */
 	      log_stderr ("killing %d to get lock.", his_pid);
 	      kill (his_pid, SIGKILL);
-	      unlink (APT_WORKER_LOCK);
+	      unlink (config_file (APT_WORKER_LOCK));
 	      sleep (1);
 	      continue;
 	    }
@@ -1407,8 +2548,10 @@ get_apt_worker_lock (bool weak)
 #define REMOVABLE_MMC_MOUNTPOINT "/media/mmc1"
 #define HOME_MOUNTPOINT  "/home"
 
+/* When WARM_UP is true, the cache is built in the background.
+ */
 static void
-misc_init ()
+misc_init (bool warm_up = false)
 {
   lc_messages = getenv ("LC_MESSAGES");
   DBG ("LC_MESSAGES %s", lc_messages);
@@ -1416,11 +2559,11 @@ misc_init ()
   DBG ("OSSO_PRODUCT_HARDWARE %s", getenv ("OSSO_PRODUCT_HARDWARE"));
 
   load_system_settings ();
-  read_domain_conf ();
 
   AptWorkerCache::Initialize ();
 
-  cache_init (false);
+  read_domain_conf ();
+  init_config_watcher ();
 
 #ifdef HAVE_APT_TRUST_HOOK
   apt_set_index_trust_level_for_package_hook (index_trust_level_for_package);
@@ -1428,6 +2571,11 @@ misc_init ()
 
   clean_temp_catalogues ();
 
+  if (warm_up)
+    start_warm_up ();
+  else
+    cache_init (false);
+
   // initialize the MMC mount points with defaults
   setenv ("INTERNAL_MMC_MOUNTPOINT", INTERNAL_MMC_MOUNTPOINT, 1);
   setenv ("REMOVABLE_MMC_MOUNTPOINT", REMOVABLE_MMC_MOUNTPOINT, 1);
@@ -1511,12 +2659,31 @@ is_fifo (const char *filename)
   return NULL;
 }
 
+/* We keep our lock, our state and look for the catalogues and
+   domains below the root of libapt-pkg.  This is "/" except when
+   testing.  The root is needed before taking the lock, and thus
+   before AptWorkerCache::Initialize sets up _config, so we read the
+   configuration into a throw-away copy here.
+*/
+static void
+init_config_root ()
+{
+  Configuration config;
+
+  if (pkgInitConfig (config))
+    set_config_root (config.FindDir ("Dir").c_str ());
+  else
+    _error->DumpErrors ();
+}
+
 int
 main (int argc, char **argv)
 {
   if (argc == 1)
     usage ();
 
+  init_config_root ();
+
   argv += 1;
   argc -= 1;
 
@@ -1572,6 +2739,7 @@ main (int argc, char **argv)
 	 non-blocking mode since we just poll it periodically.
       */
       must_set_flags (input_fd, O_RDONLY);
+      pending_input = g_byte_array_new ();
 
       options = argv[5];
 
@@ -1588,7 +2756,8 @@ main (int argc, char **argv)
 	log_stderr ("nice: %m");
 
       get_apt_worker_lock (false);
-      misc_init ();
+      g_thread_init (NULL);
+      misc_init (true);
 
       while (true)
 	handle_request ();
@@ -1642,6 +2811,9 @@ main (int argc, char **argv)
     We remember which operation the cache currently represents.  That
     way, we can avoid recomputing it when the frontend requests the
     same operation multiple times in a row (which it likes to do).
+    The outcome of the last few operations is also kept in 'sandboxes'
+    so that the frontend can ask about other packages in between
+    without forcing us to simulate the pending operation again.
 
     - cache_init
 
@@ -1663,7 +2835,10 @@ main (int argc, char **argv)
     - cache_reset ()
 
     This function resets the 'desired' state of the cache to be
-    identical to the 'current' one.
+    identical to the 'current' one.  The marking functions remember
+    which packages they have touched and cache_reset only resets
+    those, so that it costs time proportional to the size of the
+    operation, not the size of the cache.
 
     - mark_for_install ()
 
@@ -1712,6 +2887,7 @@ class DownloadStatus : public pkgAcquireStatus
     return false;
   }
 
+protected:
   virtual bool
   Pulse (pkgAcquire *Owner)
   {
@@ -1883,6 +3059,177 @@ void cache_reset ();
 static char *current_cache_package = NULL;
 static bool current_cache_is_install;
 
+/* A sandbox records the outcome of a simulated operation as the
+   difference to the reset state of the cache: the marks and flags of
+   every package that the operation has touched.  Putting a sandbox
+   back into the cache and resetting it again both cost time
+   proportional to the number of touched packages.
+
+   The sandboxes are kept in a short list with the most recently used
+   one first.  They are only valid for the cache and the domains they
+   have been made with.
+*/
+
+#define MAX_CACHE_SANDBOXES 4
+
+struct sandbox_entry {
+  guint index;
+  unsigned char mode;
+  unsigned char iflags;
+  bool autoinst : 1;
+  bool related : 1;
+  bool soft : 1;
+};
+
+struct cache_sandbox {
+  char *package;
+  bool is_install;
+  int domains_generation;
+  GArray *entries;
+};
+
+static GSList *cache_sandboxes = NULL;
+
+static void
+free_cache_sandbox (cache_sandbox *sb)
+{
+  g_free (sb->package);
+  g_array_free (sb->entries, TRUE);
+  delete sb;
+}
+
+static void
+forget_cache_sandboxes ()
+{
+  for (GSList *l = cache_sandboxes; l; l = l->next)
+    free_cache_sandbox ((cache_sandbox *)l->data);
+  g_slist_free (cache_sandboxes);
+  cache_sandboxes = NULL;
+}
+
+static GSList *
+find_cache_sandbox (const char *package, bool is_install)
+{
+  for (GSList *l = cache_sandboxes; l; l = l->next)
+    {
+      cache_sandbox *sb = (cache_sandbox *)l->data;
+      if (sb->is_install == is_install && !strcmp (sb->package, package))
+	return l;
+    }
+  return NULL;
+}
+
+/* Record the current state of the cache as the outcome of the
+   current operation.  This is not possible when the operation might
+   have touched any package.
+*/
+static void
+save_cache_sandbox ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (awc->cache == NULL || awc->cache->all_dirty
+      || current_cache_package == NULL)
+    return;
+
+  GSList *old = find_cache_sandbox (current_cache_package,
+				    current_cache_is_install);
+  if (old)
+    {
+      free_cache_sandbox ((cache_sandbox *)old->data);
+      cache_sandboxes = g_slist_delete_link (cache_sandboxes, old);
+    }
+
+  pkgDepCache &cache = *(awc->cache);
+  pkgCache &pkgcache = cache.GetCache ();
+  GArray *dirty = awc->cache->dirty_packages;
+
+  cache_sandbox *sb = new cache_sandbox;
+  sb->package = g_strdup (current_cache_package);
+  sb->is_install = current_cache_is_install;
+  sb->domains_generation = domains_generation;
+  sb->entries = g_array_sized_new (FALSE, FALSE, sizeof (sandbox_entry),
+				   dirty->len);
+
+  for (guint i = 0; i < dirty->len; i++)
+    {
+      guint index = g_array_index (dirty, guint, i);
+      pkgCache::PkgIterator pkg (pkgcache, pkgcache.PkgP + index);
+      extra_info_struct *info = &awc->cache->extra_info[pkg->ID];
+      sandbox_entry e;
+
+      e.index = index;
+      e.mode = cache[pkg].Mode;
+      e.iflags = cache[pkg].iFlags;
+      e.autoinst = (cache[pkg].Flags & pkgCache::Flag::Auto) != 0;
+      e.related = info->related;
+      e.soft = info->soft;
+      g_array_append_val (sb->entries, e);
+    }
+
+  cache_sandboxes = g_slist_prepend (cache_sandboxes, sb);
+
+  GSList *last = g_slist_nth (cache_sandboxes, MAX_CACHE_SANDBOXES - 1);
+  if (last && last->next)
+    {
+      for (GSList *l = last->next; l; l = l->next)
+	free_cache_sandbox ((cache_sandbox *)l->data);
+      g_slist_free (last->next);
+      last->next = NULL;
+    }
+}
+
+/* Put the outcome recorded in SB back into the cache, which must be
+   in its reset state.  The marks are replayed without resolving any
+   dependencies, which gives exactly the recorded states since it was
+   this set of marks that the operation produced.  Return false when
+   this did not work out, after resetting the cache again.
+*/
+static bool
+restore_cache_sandbox (cache_sandbox *sb)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  pkgCache &pkgcache = cache.GetCache ();
+  GArray *entries = sb->entries;
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      sandbox_entry &e = g_array_index (entries, sandbox_entry, i);
+      pkgCache::PkgIterator pkg (pkgcache, pkgcache.PkgP + e.index);
+      extra_info_struct *info = &awc->cache->extra_info[pkg->ID];
+
+      awc->cache->mark_dirty (pkg);
+      if (e.mode == pkgDepCache::ModeInstall)
+	cache.MarkInstall (pkg, false);
+      else if (e.mode == pkgDepCache::ModeDelete)
+	cache.MarkDelete (pkg, (e.iflags & pkgDepCache::Purge) != 0);
+      if (e.iflags & pkgDepCache::ReInstall)
+	cache.SetReInstall (pkg, true);
+
+      if (e.autoinst)
+	cache[pkg].Flags |= pkgCache::Flag::Auto;
+      else
+	cache[pkg].Flags &= ~pkgCache::Flag::Auto;
+      info->related = e.related;
+      info->soft = e.soft;
+    }
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      sandbox_entry &e = g_array_index (entries, sandbox_entry, i);
+      pkgCache::PkgIterator pkg (pkgcache, pkgcache.PkgP + e.index);
+
+      if (cache[pkg].Mode != e.mode)
+	{
+	  DBG ("Sandbox for %s did not restore", sb->package);
+	  cache_reset ();
+	  return false;
+	}
+    }
+
+  return true;
+}
+
 static bool
 check_cache_state (const char *package, bool is_install)
 {
@@ -1894,19 +3241,40 @@ check_cache_state (const char *package, bool is_install)
   if (current_cache_package)
     cache_reset ();
 
+  GSList *l = find_cache_sandbox (package, is_install);
+  if (l)
+    {
+      cache_sandbox *sb = (cache_sandbox *)l->data;
+      cache_sandboxes = g_slist_delete_link (cache_sandboxes, l);
+
+      if (sb->domains_generation == domains_generation
+	  && restore_cache_sandbox (sb))
+	{
+	  cache_sandboxes = g_slist_prepend (cache_sandboxes, sb);
+	  current_cache_package = g_strdup (package);
+	  current_cache_is_install = is_install;
+	  return true;
+	}
+
+      free_cache_sandbox (sb);
+    }
+
   current_cache_package = g_strdup (package);
   current_cache_is_install = is_install;
   return false;
 }
 
-/* Initialize libapt-pkg if this has not been done already and
-   (re-)create PACKAGE_CACHE.  If the cache can not be created,
-   PACKAGE_CACHE is set to NULL and an appropriate message is output.
-   */
-void
-cache_init (bool with_status)
+/* (Re-)create the cache.  When CARRIED_EXTRA_INFO is non-NULL, the
+   extra_info is taken from it instead of being loaded from disk.
+ */
+static void
+cache_open (bool with_status, GArray *carried_extra_info)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  int64_t start = wall_usecs ();
+
+  stop_query_service ();
+  forget_cache_sandboxes ();
 
   /* Closes the cache, to prevent getting blocked by other locks in
    * dpkg structures. If we don't do it, changing the apt worker state
@@ -1936,7 +3304,7 @@ cache_init (bool with_status)
   awc->cache = new myCacheFile;
 
   DBG ("init.");
-  if (!awc->cache->Open (progress))
+  if (!awc->cache->Open (progress, true, carried_extra_info))
     {
       DBG ("failed.");
       _error->DumpErrors ();
@@ -1955,10 +3323,58 @@ cache_init (bool with_status)
       awc->action_group = new pkgDepCache::ActionGroup (cache);
     }
 
+  remember_package_list_snapshot_key (awc->cache != NULL);
+  remember_cache_sources_digest (awc->cache != NULL);
+
   cache_reset ();
 
   if (awc->cache)
-    write_available_updates_file ();
+    {
+      int64_t updates_file_start = wall_usecs ();
+      write_available_updates_file ();
+      thread_stats ()->updates_file_usecs += wall_usecs () - updates_file_start;
+    }
+
+  int64_t elapsed = wall_usecs () - start;
+  thread_stats ()->cache_inits += 1;
+  thread_stats ()->cache_init_usecs += elapsed;
+  total_cache_inits += 1;
+  total_cache_init_usecs += elapsed;
+}
+
+/* Initialize libapt-pkg if this has not been done already and
+   (re-)create PACKAGE_CACHE.  If the cache can not be created,
+   PACKAGE_CACHE is set to NULL and an appropriate message is output.
+   */
+void
+cache_init (bool with_status)
+{
+  cache_open (with_status, NULL);
+}
+
+/* Re-create the cache after only the dpkg status has changed.
+
+   Libapt-pkg keeps the part of the cache that comes from the Packages
+   lists in srcpkgcache.bin and, as long as the lists have not
+   changed, only merges the dpkg status into it when building the
+   cache.  What would remain is looking up every package of the
+   extra info store again, so we carry the extra_info over from the
+   old cache instead, unless the store has been changed since.
+*/
+void
+cache_refresh ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  GArray *carried = NULL;
+
+  if (awc->cache && awc->cache->extra_info_saved
+      && read_extra_info_generation () == extra_info_generation)
+    carried = awc->cache->remember_extra_info ();
+
+  cache_open (false, carried);
+
+  if (carried)
+    free_carried_extra_info (carried);
 }
 
 bool
@@ -2004,6 +3420,7 @@ mark_related (const pkgCache::VerIterator &ver)
     return;
 
   awc->cache->extra_info[pkg->ID].related = true;
+  awc->cache->mark_dirty (pkg);
 
   pkgDepCache &cache = *awc->cache;
 
@@ -2075,8 +3492,25 @@ cache_reset ()
 
   pkgDepCache &cache = *(awc->cache);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-    cache_reset_package (pkg);
+  if (awc->cache->all_dirty)
+    {
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	cache_reset_package (pkg);
+    }
+  else
+    {
+      pkgCache &pkgcache = cache.GetCache ();
+      GArray *dirty = awc->cache->dirty_packages;
+
+      for (guint i = 0; i < dirty->len; i++)
+	{
+	  pkgCache::PkgIterator pkg (pkgcache,
+				     (pkgcache.PkgP
+				      + g_array_index (dirty, guint, i)));
+	  cache_reset_package (pkg);
+	}
+    }
+  awc->cache->clear_dirty ();
 
   g_free (current_cache_package);
   current_cache_package = NULL;
@@ -2258,6 +3692,7 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
   /* Now mark it and return if that fails.  Both ModeInstall and
      ModeKeep are fine.  ModeKeep only happens for broken packages.
    */
+  awc->cache->mark_dirty (pkg);
   cache.MarkInstall (pkg, false);
   if (cache[pkg].Mode != pkgDepCache::ModeInstall
       && cache[pkg].Mode != pkgDepCache::ModeKeep)
@@ -2390,6 +3825,10 @@ mark_for_install (pkgCache::PkgIterator &pkg)
       pkgDepCache &Cache = *(awc->cache);
       pkgDepCache::StateCache &State = Cache[pkg];
 
+      /* The problem resolver might touch any package.
+       */
+      awc->cache->mark_all_dirty ();
+
       pkgProblemResolver Fix(&Cache);
 
       Fix.Clear(pkg);
@@ -2452,6 +3891,7 @@ mark_named_package_for_install (const char *package)
   if (!strcmp (package, "magic:sys"))
     {
       mark_sys_upgrades ();
+      save_cache_sandbox ();
       return true;
     }
   else
@@ -2461,6 +3901,7 @@ mark_named_package_for_install (const char *package)
       if (!pkg.end())
 	{
 	  mark_for_install (pkg);
+	  save_cache_sandbox ();
 	  return true;
 	}
       else
@@ -2482,6 +3923,7 @@ mark_for_remove_1 (pkgCache::PkgIterator &pkg, bool soft)
 
   DBG ("- %s%s", pkg.Name(), soft? " (soft)" : "");
 
+  awc->cache->mark_dirty (pkg);
   cache.MarkDelete (pkg);
   cache[pkg].Flags &= ~pkgCache::Flag::Auto;
   awc->cache->extra_info[pkg->ID].soft = soft;
@@ -2525,6 +3967,10 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
       AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
       pkgDepCache &Cache = *(awc->cache);
 
+      /* The problem resolver might touch any package.
+       */
+      awc->cache->mark_all_dirty ();
+
       pkgProblemResolver Fix(&Cache);
 
       Fix.Clear(pkg);
@@ -2541,6 +3987,7 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
     {
       mark_for_remove_1 (pkg, false);
       fix_soft_packages ();
+      save_cache_sandbox ();
     }
 }
 
@@ -2577,6 +4024,7 @@ struct package_record {
   */
   
   valid = section.Scan (start, stop-start+1);
+  thread_stats ()->records_looked_up += 1;
     }
 };
 
@@ -2664,59 +4112,193 @@ package_record::get_localized_string (const char *tag)
    version.
  */
 
-bool
-name_matches_pattern (pkgCache::PkgIterator &pkg,
-		      const char *pattern)
-{
-  bool match = false;
-  char **words = g_strsplit (pattern, " ", 0);
-  int i;
+/* Searching in the descriptions is done with the help of an index
+   that stores a small signature for each version: a bit set with one
+   bit for each trigram (three consecutive characters, folded to lower
+   case) of its long description, hashed into SEARCH_SIGNATURE_BITS
+   bits.  The index is built the first time it is needed and lives as
+   long as the cache.  It takes SEARCH_SIGNATURE_BITS / 8 bytes per
+   version, regardless of how long the descriptions are, which is
+   about 2.5 MB for 20000 versions.
+
+   A version can only match a word when its signature has the bits of
+   all trigrams of that word, so the index quickly rules out most
+   versions.  Different trigrams can share a bit, and the remaining
+   candidates are checked for real, which keeps the matching exactly
+   the same as a plain strcasestr over all descriptions.
+
+   Building the index reads all package records and can be
+   cancelled.  The partial index is thrown away then.
+*/
 
-  if (words == NULL)
-    return false;
+#define SEARCH_SIGNATURE_BITS  1024
+#define SEARCH_SIGNATURE_WORDS (SEARCH_SIGNATURE_BITS / 32)
 
-  for (i = 0; words[i] != NULL; i++)
-    if (strcasestr (pkg.Name(), words[i]))
-      match = true;
-    else
-      {
-        match = false;
-        break;
-      }
+static guint
+trigram_bit_at (const char *p)
+{
+  guint trigram = (((guint) (guchar) g_ascii_tolower (p[0]) << 16)
+		   | ((guint) (guchar) g_ascii_tolower (p[1]) << 8)
+		   | ((guint) (guchar) g_ascii_tolower (p[2])));
 
-  g_strfreev (words);
-  return match;
+  return ((trigram * 2654435761U) >> 16) % SEARCH_SIGNATURE_BITS;
 }
 
-bool
-description_matches_pattern (pkgCache::VerIterator &ver,
-			     const char *pattern)
+static void
+add_text_to_signature (guint32 *signature, const char *text)
 {
-  bool match = false;
-  char **words = g_strsplit (pattern, " ", 0);
-  package_record rec;
-  rec.lookup(ver);
-  const char *desc = rec.P->LongDesc().c_str();
-  int i;
-
-  if (words == NULL)
-    return false;
+  int len = strlen (text);
 
-  for (i = 0; words[i] != NULL; i++)
-    if (strcasestr (desc, words[i]))  // XXX - UTF8?
-      match = true;
-    else
-      {
-        match = false;
-        break;
-      }
-
-  g_strfreev (words);
-  return match;
+  for (int i = 0; i + 3 <= len; i++)
+    {
+      guint bit = trigram_bit_at (text + i);
+      signature[bit / 32] |= 1U << (bit % 32);
+    }
 }
 
-static string
-get_description (int summary_kind,
+static bool
+signature_contains (const guint32 *signature, const guint32 *pattern)
+{
+  for (int i = 0; i < SEARCH_SIGNATURE_WORDS; i++)
+    if ((signature[i] & pattern[i]) != pattern[i])
+      return false;
+
+  return true;
+}
+
+/* Returns NULL when building the index has been cancelled.
+ */
+static guint32 *
+get_search_index ()
+{
+  myCacheFile *cache = AptWorkerCache::GetCurrent ()->cache;
+
+  if (cache->search_index == NULL)
+    {
+      pkgDepCache &depcache = *cache;
+      package_record rec;
+
+      cache->search_index =
+	g_new0 (guint32, (depcache.GetCache().Head().VersionCount
+			  * SEARCH_SIGNATURE_WORDS));
+
+      for (pkgCache::PkgIterator pkg = depcache.PkgBegin(); !pkg.end (); pkg++)
+	{
+	  if (read_byte (cancel_fd) >= 0)
+	    {
+	      cache->free_search_index ();
+	      return NULL;
+	    }
+
+	  for (pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ver++)
+	    {
+	      rec.lookup (ver);
+	      add_text_to_signature (cache->search_index
+				     + ver->ID * SEARCH_SIGNATURE_WORDS,
+				     rec.P->LongDesc().c_str());
+	    }
+	}
+    }
+
+  return cache->search_index;
+}
+
+void
+myCacheFile::free_search_index ()
+{
+  g_free (search_index);
+  search_index = NULL;
+}
+
+struct package_search {
+
+  package_search (const char *pattern);
+  ~package_search ();
+
+  bool name_matches (pkgCache::PkgIterator &pkg);
+  bool description_matches (pkgCache::VerIterator &ver);
+
+  /* True when the search has been cancelled while building the
+     index.
+  */
+  bool cancelled;
+
+private:
+  char **words;
+  bool all_words_in (const char *text);
+
+  /* PATTERN has the bits of all trigrams of all words.  INDEX is
+     NULL when no word is long enough to have a trigram.
+  */
+  guint32 pattern[SEARCH_SIGNATURE_WORDS];
+  guint32 *index;
+
+  package_record *rec;
+};
+
+package_search::package_search (const char *pattern_string)
+{
+  bool have_trigrams = false;
+
+  words = g_strsplit (pattern_string, " ", 0);
+  memset (pattern, 0, sizeof (pattern));
+  index = NULL;
+  cancelled = false;
+  rec = NULL;
+
+  for (int i = 0; words[i]; i++)
+    {
+      if (strlen (words[i]) >= 3)
+	have_trigrams = true;
+      add_text_to_signature (pattern, words[i]);
+    }
+
+  if (have_trigrams)
+    {
+      index = get_search_index ();
+      cancelled = (index == NULL);
+    }
+}
+
+package_search::~package_search ()
+{
+  g_strfreev (words);
+  delete rec;
+}
+
+bool
+package_search::all_words_in (const char *text)
+{
+  for (int i = 0; words[i] != NULL; i++)
+    if (!strcasestr (text, words[i]))  // XXX - UTF8?
+      return false;
+
+  return words[0] != NULL;
+}
+
+bool
+package_search::name_matches (pkgCache::PkgIterator &pkg)
+{
+  return all_words_in (pkg.Name ());
+}
+
+bool
+package_search::description_matches (pkgCache::VerIterator &ver)
+{
+  if (index && !signature_contains (index + ver->ID * SEARCH_SIGNATURE_WORDS,
+				    pattern))
+    return false;
+
+  if (rec == NULL)
+    rec = new package_record;
+  rec->lookup (ver);
+
+  string desc = rec->P->LongDesc();
+  return all_words_in (desc.c_str ());
+}
+
+static string
+get_description (int summary_kind,
 		 pkgCache::PkgIterator &pkg,
 		 package_record &rec)
 {
@@ -2806,24 +4388,522 @@ get_required_free_space (package_record &rec)
   return 1024 * (int64_t) rec.get_int ("Maemo-Required-Free-Space", 0);
 }
 
+/* Return the parsed Maemo specific fields of VER.  The package record
+   of VER is only looked at the first time a version is asked for;
+   the result is remembered in the VERSION_INFO array of the cache
+   until the cache is reconstructed.  VER must not be an end
+   iterator.
+*/
+static const version_info_struct *
+get_version_info (const pkgCache::VerIterator &ver)
+{
+  myCacheFile *cache = AptWorkerCache::GetCurrent ()->cache;
+
+  if (cache->version_info == NULL)
+    {
+      pkgDepCache &depcache = *cache;
+      int n = depcache.GetCache().Head().VersionCount;
+      cache->version_info = g_new0 (version_info_struct, n);
+      cache->version_info_count = n;
+    }
+
+  version_info_struct *info = &cache->version_info[ver->ID];
+  if (!info->valid)
+    {
+      if (cache->version_info_rec == NULL)
+	cache->version_info_rec = new package_record;
+
+      package_record &rec = *cache->version_info_rec;
+      rec.lookup (ver);
+
+      info->flags = get_flags (rec);
+      info->required_free_space = get_required_free_space (rec);
+      info->has_icon = rec.has ("Maemo-Icon-26");
+
+      string pretty_name = get_pretty_name (rec);
+      info->pretty_name = (pretty_name.empty()
+			   ? NULL
+			   : g_strdup (pretty_name.c_str ()));
+
+      info->valid = true;
+    }
+
+  return info;
+}
+
+static int
+get_version_flags (const pkgCache::VerIterator &ver)
+{
+  return get_version_info (ver)->flags;
+}
+
+/* Returns NULL when VER has no display name.
+ */
+static const char *
+get_version_pretty_name (const pkgCache::VerIterator &ver)
+{
+  return get_version_info (ver)->pretty_name;
+}
+
+static int64_t
+get_version_required_free_space (const pkgCache::VerIterator &ver)
+{
+  return get_version_info (ver)->required_free_space;
+}
+
+/* Icons are identified by the MD5 sum of their base64 encoded data.
+ */
+static char *
+compute_icon_hash (const char *icon)
+{
+  return g_compute_checksum_for_string (G_CHECKSUM_MD5, icon, -1);
+}
+
+/* Return the hash of the icon of VER, or NULL when VER has no icon.
+   REC must have been looked up for VER already.
+*/
+static const char *
+get_version_icon_hash (const pkgCache::VerIterator &ver,
+		       package_record &rec)
+{
+  version_info_struct *info =
+    (version_info_struct *) get_version_info (ver);
+
+  if (!info->icon_hash_valid)
+    {
+      if (info->has_icon)
+	{
+	  char *icon = get_icon (rec);
+	  if (icon)
+	    info->icon_hash = compute_icon_hash (icon);
+	  g_free (icon);
+	}
+      info->icon_hash_valid = true;
+    }
+
+  return info->icon_hash;
+}
+
+void
+myCacheFile::free_version_info ()
+{
+  if (version_info)
+    {
+      for (int i = 0; i < version_info_count; i++)
+	{
+	  g_free (version_info[i].pretty_name);
+	  g_free (version_info[i].icon_hash);
+	}
+      g_free (version_info);
+      version_info = NULL;
+    }
+
+  delete version_info_rec;
+  version_info_rec = NULL;
+}
+
+/* WARMING UP
+
+   Building the cache takes a long time and the frontend can't show
+   much until it is done.  Therefore, the cache is built in a
+   background thread right after starting up and after the catalogues
+   have been changed.  The warm-up also parses the package records
+   that the package list needs.
+
+   Meanwhile, requests that don't need the cache are handled as usual.
+   All others wait for the warm-up to finish first, see
+   command_needs_cache.  Libapt-pkg is not thread-safe, not even its
+   global error stack, so the main thread must stay away from it
+   completely while the warm-up thread runs.
+*/
+
+static GThread *warm_up_thread = NULL;
+
+static gpointer
+warm_up_cache (gpointer unused)
+{
+  int64_t start_wall = wall_usecs ();
+  int64_t start_cpu = thread_cpu_usecs ();
+
+  g_static_private_set (&in_warm_up_thread, GINT_TO_POINTER (1), NULL);
+  memset (&warm_up_stats, 0, sizeof (warm_up_stats));
+  warm_up_stats.cmd = STATS_CMD_WARM_UP;
+
+  cache_init (false);
+
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (awc->cache)
+    {
+      pkgDepCache &cache = *(awc->cache);
+
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	{
+	  pkgCache::VerIterator installed = pkg.CurrentVer ();
+	  pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+	  if (!installed.end ())
+	    get_version_info (installed);
+	  if (!candidate.end ())
+	    get_version_info (candidate);
+	}
+    }
+
+  _error->DumpErrors ();
+
+  warm_up_stats.wall_usecs = wall_usecs () - start_wall;
+  warm_up_stats.cpu_usecs = thread_cpu_usecs () - start_cpu;
+  return NULL;
+}
+
+static void
+start_warm_up ()
+{
+  GError *error = NULL;
+
+  finish_warm_up ();
+
+  warm_up_thread = g_thread_create (warm_up_cache, NULL, TRUE, &error);
+  if (warm_up_thread == NULL)
+    {
+      log_stderr ("can't start warm-up: %s", error->message);
+      g_error_free (error);
+      cache_init (false);
+    }
+}
+
+static void
+finish_warm_up ()
+{
+  if (warm_up_thread)
+    {
+      g_thread_join (warm_up_thread);
+      warm_up_thread = NULL;
+      remember_request_stats (&warm_up_stats);
+    }
+}
+
+static bool
+warming_up ()
+{
+  return warm_up_thread != NULL;
+}
+
+/* QUERY SERVICE
+
+   Long operations like installing a package or refreshing the
+   catalogues keep the apt-worker busy for minutes.  So that the
+   frontend can still show package details and the like in the mean
+   time, read-only queries are answered by a child process while such
+   an operation runs.  The child is forked right before the operation
+   starts and thus works with its own copy of the cache.  It never
+   writes anything to disk.
+
+   A thread in the main process reads all requests that arrive during
+   the operation.  Queries are passed on to the child over a socket,
+   everything else is put into PENDING_INPUT and handled after the
+   operation, as usual.  Once a request has been put aside that way,
+   the queries behind it are put aside as well so that they see its
+   effects.
+
+   The child writes its responses directly to OUTPUT_FD.  The frontend
+   matches responses with requests by their sequence number, so they
+   may overtake the response to the operation.
+
+   The child must be stopped before the operation changes anything on
+   disk that its cache refers to: the package lists, the cache files
+   themselves, and the dpkg status, which the package records of
+   installed packages are read from.  Thus, it only serves queries
+   while the operation downloads.  Stopping it waits until it has
+   answered all queries that have been passed on to it.
+*/
+
+static pid_t query_pid = -1;
+static int query_fd = -1;
+static int query_stop_fds[2] = { -1, -1 };
+static bool query_forwarding;
+
+static bool
+command_is_query (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_GET_PACKAGE_LIST:
+    case APTCMD_GET_PACKAGE_INFO:
+    case APTCMD_GET_PACKAGE_INFOS:
+    case APTCMD_GET_PACKAGE_DETAILS:
+    case APTCMD_GET_ICONS:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+      return true;
+
+    default:
+      return false;
+    }
+}
+
+/* Only operations that download something are worth a query
+   service.  Removing a package goes straight to dpkg, and the child
+   would be stopped again right after forking it.
+*/
+static bool
+command_is_long (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_CHECK_UPDATES:
+    case APTCMD_DOWNLOAD_PACKAGE:
+    case APTCMD_INSTALL_PACKAGE:
+      return true;
+
+    default:
+      return false;
+    }
+}
+
+static bool
+read_fully (int fd, void *buf, size_t n)
+{
+  while (n > 0)
+    {
+      ssize_t r = read (fd, buf, n);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      n -= r;
+      buf = ((char *)buf) + r;
+    }
+  return true;
+}
+
+/* This uses send instead of write so that we get an error instead of
+   a SIGPIPE when the child has gone away.
+*/
+static bool
+send_fully (int fd, const void *buf, size_t n)
+{
+  while (n > 0)
+    {
+      ssize_t r = send (fd, buf, n, MSG_NOSIGNAL);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	return false;
+      n -= r;
+      buf = ((const char *)buf) + r;
+    }
+  return true;
+}
+
+static gpointer
+dispatch_queries (gpointer unused)
+{
+  while (true)
+    {
+      struct pollfd fds[2];
+
+      fds[0].fd = input_fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = query_stop_fds[0];
+      fds[1].events = POLLIN;
+
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("apt-worker poll");
+	  break;
+	}
+
+      if (fds[1].revents)
+	break;
+
+      /* If the frontend goes away while we read, the main process
+	 will notice when it reads the next request itself.
+      */
+      apt_request_header req;
+      if (!read_fully (input_fd, &req, sizeof (req)))
+	break;
+
+      size_t len = sizeof (req) + req.len;
+      char *buf = (char *)g_malloc (len);
+      memcpy (buf, &req, sizeof (req));
+      if (!read_fully (input_fd, buf + sizeof (req), req.len))
+	{
+	  g_free (buf);
+	  break;
+	}
+
+      if (!(query_forwarding
+	    && command_is_query (req.cmd)
+	    && send_fully (query_fd, buf, len)))
+	{
+	  query_forwarding = false;
+	  g_byte_array_append (pending_input, (guint8 *)buf, len);
+	}
+
+      g_free (buf);
+    }
+
+  return NULL;
+}
+
+static void
+close_query_fds ()
+{
+  if (query_fd >= 0)
+    close (query_fd);
+  if (query_stop_fds[0] >= 0)
+    close (query_stop_fds[0]);
+  if (query_stop_fds[1] >= 0)
+    close (query_stop_fds[1]);
+  if (output_lock_fd >= 0)
+    close (output_lock_fd);
+
+  query_fd = query_stop_fds[0] = query_stop_fds[1] = output_lock_fd = -1;
+}
+
+static void
+start_query_service ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  char lock_name[] = "/tmp/apt-worker-lock.XXXXXX";
+  int sv[2];
+
+  if (pending_input == NULL || awc->cache == NULL
+      || !g_thread_supported () || query_pid >= 0)
+    return;
+
+  if (pipe (query_stop_fds) < 0)
+    {
+      perror ("apt-worker pipe");
+      return;
+    }
+
+  output_lock_fd = mkstemp (lock_name);
+  if (output_lock_fd < 0)
+    {
+      perror (lock_name);
+      close_query_fds ();
+      return;
+    }
+  unlink (lock_name);
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+      perror ("apt-worker socketpair");
+      close_query_fds ();
+      return;
+    }
+
+  /* Dpkg and the maintainer scripts should not see any of these.
+   */
+  fcntl (sv[0], F_SETFD, FD_CLOEXEC);
+  fcntl (sv[1], F_SETFD, FD_CLOEXEC);
+  fcntl (query_stop_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (query_stop_fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl (output_lock_fd, F_SETFD, FD_CLOEXEC);
+
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      perror ("apt-worker fork");
+      close (sv[0]);
+      close (sv[1]);
+      close_query_fds ();
+      return;
+    }
+
+  if (pid == 0)
+    {
+      /* The child reads its requests from the socket and must leave
+	 the cancel fifo and the inotify events to the main process.
+	 It does not look at the sources, and the domains are checked
+	 the slow way.
+      */
+      is_query_child = true;
+
+      close (sv[0]);
+      close (query_stop_fds[0]);
+      close (query_stop_fds[1]);
+      input_fd = sv[1];
+      cancel_fd = -1;
+      g_byte_array_free (pending_input, TRUE);
+      pending_input = NULL;
+
+      if (config_watch_fd >= 0)
+	close (config_watch_fd);
+      config_watch_fd = -1;
+      config_unwatched = CONFIG_ALL;
+
+      while (true)
+	handle_request ();
+    }
+
+  close (sv[1]);
+  query_pid = pid;
+  query_fd = sv[0];
+
+  /* Requests that have already been read ahead come first.
+   */
+  query_forwarding = (pending_input->len == 0);
+
+  GError *error = NULL;
+  query_thread = g_thread_create (dispatch_queries, NULL, TRUE, &error);
+  if (query_thread == NULL)
+    {
+      log_stderr ("can't start query service: %s", error->message);
+      g_error_free (error);
+      stop_query_service ();
+    }
+}
+
+static void
+stop_query_service ()
+{
+  if (query_pid < 0)
+    return;
+
+  if (query_thread)
+    {
+      if (write (query_stop_fds[1], "", 1) != 1)
+	perror ("apt-worker write");
+      g_thread_join (query_thread);
+      query_thread = NULL;
+    }
+
+  /* This lets the child see the end of its input once it has
+     answered everything.
+  */
+  close (query_fd);
+  query_fd = -1;
+
+  int status;
+  while (waitpid (query_pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  query_pid = -1;
+
+  close_query_fds ();
+}
+
 static void
 encode_version_info (int summary_kind, package_record &rec,
 		     const pkgCache::VerIterator &ver, bool include_size)
 {
-  char *icon;
+  const version_info_struct *info = get_version_info (ver);
 
   response.encode_string (ver.VerStr ());
   if (include_size)
     response.encode_int64 (ver->InstalledSize);
   response.encode_string (ver.Section ());
-  string pretty = get_pretty_name (rec);
-  response.encode_string (pretty.empty()? NULL : pretty.c_str());
+  response.encode_string (info->pretty_name);
   pkgCache::PkgIterator pkg = ver.ParentPkg();
   response.encode_string 
     (get_short_description (summary_kind, pkg, rec).c_str());
-  icon = get_icon (rec);
-  response.encode_string (icon);
-  g_free (icon);
+  response.encode_string (get_version_icon_hash (ver, rec));
 }
 
 static void
@@ -2866,6 +4946,237 @@ ssu_packages_set (GSList *ssu_list)
     }
 }
 
+/* The snapshot of the package list.
+
+   Computing the response to GET_PACKAGE_LIST requires looking at the
+   package records of almost all packages, which is slow.  Thus, we
+   store the complete response to the last request without a search
+   pattern in PACKAGE_LIST_SNAPSHOT.  When the same request is made
+   again and the current cache has been built from the same input,
+   the response is copied directly from the snapshot.
+
+   The input of the cache is identified by the modification times of
+   pkgcache.bin, the dpkg status, and the domain and catalogue
+   configuration as they were when the cache was opened.  This key is
+   taken by CACHE_INIT.  The request parameters, the options and the
+   locale are part of the key as well, since they influence the
+   response.
+
+   The snapshot also contains the names of the SSU packages that have
+   been found while computing the response so that SSU_PACKAGES can be
+   refreshed without a walk over the cache.
+
+   The file consists of a PACKAGE_LIST_SNAPSHOT_HEADER, followed by
+   LOCALE_LEN bytes for the locale, SSU_LEN bytes for the SSU package
+   names (each terminated by a null byte), and PAYLOAD_LEN bytes of
+   response.  The lengths are multiples of sizeof (int).
+*/
+
+#define PACKAGE_LIST_SNAPSHOT_MAGIC   0x48414d53
+#define PACKAGE_LIST_SNAPSHOT_VERSION 2
+
+struct package_list_snapshot_header {
+  int magic;
+  int version;
+  int64_t pkgcache_mtime;
+  int64_t pkgcache_size;
+  int64_t status_mtime;
+  int64_t domains_mtime;
+  int64_t catalogues_mtime;
+  int params;
+  int locale_len;
+  int ssu_len;
+  int payload_len;
+};
+
+static package_list_snapshot_header package_list_snapshot_key;
+static bool package_list_snapshot_key_valid = false;
+
+static int64_t
+snapshot_file_mtime (const char *filename, int64_t *size = NULL)
+{
+  struct stat buf;
+
+  if (stat (filename, &buf) < 0)
+    return -1;
+
+  if (size)
+    *size = buf.st_size;
+  return buf.st_mtime;
+}
+
+static void
+remember_package_list_snapshot_key (bool valid)
+{
+  package_list_snapshot_header &key = package_list_snapshot_key;
+  string pkgcache = _config->FindFile ("Dir::Cache::pkgcache");
+  string status = _config->FindFile ("Dir::State::status");
+
+  package_list_snapshot_key_valid = false;
+  if (!valid || pkgcache.empty ())
+    return;
+
+  memset (&key, 0, sizeof (key));
+  key.magic = PACKAGE_LIST_SNAPSHOT_MAGIC;
+  key.version = PACKAGE_LIST_SNAPSHOT_VERSION;
+  key.pkgcache_mtime = snapshot_file_mtime (pkgcache.c_str (),
+					    &key.pkgcache_size);
+  key.status_mtime = snapshot_file_mtime (status.c_str ());
+  key.domains_mtime = snapshot_file_mtime (config_file (PACKAGE_DOMAINS));
+  key.catalogues_mtime =
+    max (snapshot_file_mtime (config_file (CATALOGUE_CONF)),
+	 snapshot_file_mtime (config_file (PACKAGE_CATALOGUES)));
+
+  package_list_snapshot_key_valid = (key.pkgcache_mtime != -1
+				     && key.status_mtime != -1);
+}
+
+static int
+package_list_snapshot_params (bool only_user, bool only_installed,
+			      bool only_available, bool show_magic_sys)
+{
+  return ((only_user? 1 : 0)
+	  | (only_installed? 2 : 0)
+	  | (only_available? 4 : 0)
+	  | (show_magic_sys? 8 : 0)
+	  | (flag_allow_wrong_domains? 16 : 0));
+}
+
+static int
+package_list_snapshot_locale_len ()
+{
+  int len = lc_messages? strlen (lc_messages) + 1 : 0;
+  return (len + sizeof (int) - 1) / sizeof (int) * sizeof (int);
+}
+
+static bool
+package_list_snapshot_key_matches (const package_list_snapshot_header *hdr,
+				   const char *locale, int params)
+{
+  const package_list_snapshot_header &key = package_list_snapshot_key;
+
+  return (hdr->magic == key.magic
+	  && hdr->version == key.version
+	  && hdr->pkgcache_mtime == key.pkgcache_mtime
+	  && hdr->pkgcache_size == key.pkgcache_size
+	  && hdr->status_mtime == key.status_mtime
+	  && hdr->domains_mtime == key.domains_mtime
+	  && hdr->catalogues_mtime == key.catalogues_mtime
+	  && hdr->params == params
+	  && hdr->locale_len == package_list_snapshot_locale_len ()
+	  && (lc_messages == NULL
+	      || strcmp (locale, lc_messages) == 0));
+}
+
+/* Put the response from the snapshot into RESPONSE, if possible.
+   Returns true when this has been done.
+*/
+static bool
+serve_package_list_snapshot (int params)
+{
+  struct stat buf;
+  bool success = false;
+
+  if (!package_list_snapshot_key_valid)
+    return false;
+
+  int fd = open (config_file (PACKAGE_LIST_SNAPSHOT), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (fstat (fd, &buf) < 0
+      || buf.st_size < (off_t) sizeof (package_list_snapshot_header))
+    {
+      close (fd);
+      return false;
+    }
+
+  void *map = mmap (NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const package_list_snapshot_header *hdr =
+    (const package_list_snapshot_header *) map;
+  const char *locale = (const char *)(hdr + 1);
+  const char *ssu = locale + hdr->locale_len;
+  const char *payload = ssu + hdr->ssu_len;
+
+  if (hdr->locale_len >= 0 && hdr->ssu_len >= 0 && hdr->payload_len >= 0
+      && (buf.st_size == (off_t) (sizeof (package_list_snapshot_header)
+				  + hdr->locale_len
+				  + hdr->ssu_len
+				  + hdr->payload_len))
+      && package_list_snapshot_key_matches (hdr, locale, params))
+    {
+      if (ssu_packages_needs_refresh)
+	{
+	  GSList *ssu_list = NULL;
+	  for (const char *p = ssu; p < payload && *p; p += strlen (p) + 1)
+	    ssu_list = g_slist_prepend (ssu_list, g_strdup (p));
+	  ssu_packages_set (g_slist_reverse (ssu_list));
+	  g_slist_free (ssu_list);
+	  ssu_packages_needs_refresh = false;
+	}
+
+      response.encode_mem (payload, hdr->payload_len);
+      success = true;
+    }
+
+  munmap (map, buf.st_size);
+  return success;
+}
+
+/* Write the current RESPONSE to the snapshot, together with SSU_LIST,
+   the names of the SSU packages that have been found while computing
+   it.  The snapshot is replaced atomically.  It is only a cache, so
+   we don't care much about errors.
+*/
+static void
+save_package_list_snapshot (int params, GSList *ssu_list)
+{
+  package_list_snapshot_header hdr;
+  apt_proto_encoder extra;
+  int locale_len = package_list_snapshot_locale_len ();
+
+  if (!package_list_snapshot_key_valid || is_query_child)
+    return;
+
+  if (lc_messages)
+    extra.encode_mem_plus_zeros (lc_messages, strlen (lc_messages), 1);
+  for (GSList *l = ssu_list; l; l = l->next)
+    {
+      const char *name = (const char *)l->data;
+      extra.encode_mem_plus_zeros (name, strlen (name), 1);
+    }
+  extra.encode_int (0);
+
+  hdr = package_list_snapshot_key;
+  hdr.params = params;
+  hdr.locale_len = locale_len;
+  hdr.ssu_len = extra.get_len () - locale_len;
+  hdr.payload_len = response.get_len ();
+
+  char *tmp = g_strdup_printf ("%s.new",
+			       config_file (PACKAGE_LIST_SNAPSHOT));
+  FILE *f = fopen (tmp, "w");
+  if (f)
+    {
+      bool ok = (fwrite (&hdr, sizeof (hdr), 1, f) == 1
+		 && fwrite (extra.get_buf (), extra.get_len (), 1, f) == 1
+		 && fwrite (response.get_buf (), response.get_len (), 1, f) == 1);
+      if (fclose (f) != 0)
+	ok = false;
+
+      if (!ok || rename (tmp, config_file (PACKAGE_LIST_SNAPSHOT)) < 0)
+	{
+	  log_stderr ("%s: %m", config_file (PACKAGE_LIST_SNAPSHOT));
+	  unlink (tmp);
+	}
+    }
+  g_free (tmp);
+}
+
 void
 cmd_get_package_list ()
 {
@@ -2876,6 +5187,11 @@ cmd_get_package_list ()
   const char *pattern = request.decode_string_in_place ();
   bool show_magic_sys = request.decode_int ();
   GSList *ssu_pkgs_found = NULL;
+  int snapshot_params = package_list_snapshot_params (only_user,
+						      only_installed,
+						      only_available,
+						      show_magic_sys);
+  bool collect_ssu_pkgs = ssu_packages_needs_refresh || pattern == NULL;
 
   if (!ensure_cache (true))
     {
@@ -2883,11 +5199,21 @@ cmd_get_package_list ()
       return;
     }
 
+  if (pattern == NULL && serve_package_list_snapshot (snapshot_params))
+    return;
+
   response.encode_int (1);
   pkgDepCache &cache = *(awc->cache);
 
   package_record irec;
   package_record crec;
+  package_search *search = pattern? new package_search (pattern) : NULL;
+
+  if (search && search->cancelled)
+    {
+      delete search;
+      return;
+    }
 
   for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
     {
@@ -2896,7 +5222,10 @@ cmd_get_package_list ()
       bool irec_looked = false;
 
       if (read_byte (cancel_fd) >= 0)
-        return;
+        {
+          delete search;
+          return;
+        }
 
       /* Get installed and candidate iterators for current package */
       pkgCache::VerIterator installed = pkg.CurrentVer ();
@@ -2932,10 +5261,10 @@ cmd_get_package_list ()
 
       // skip packages that don't match the pattern if requested
       //
-      if (pattern
-	  && !(name_matches_pattern (pkg, pattern)
-	       || (!iend && description_matches_pattern (installed, pattern))
-	       || (!cend && description_matches_pattern (candidate, pattern))))
+      if (search
+	  && !(search->name_matches (pkg)
+	       || (!iend && search->description_matches (installed))
+	       || (!cend && search->description_matches (candidate))))
 	continue;
 
       // Look for the SSU package if needed
@@ -2943,20 +5272,12 @@ cmd_get_package_list ()
       if (!iend || !cend)
         {
           if(!cend)
-            {
-              crec.lookup(candidate);
-              crec_looked = true;
-              flags = get_flags (crec);
-            }
+            flags = get_version_flags (candidate);
           else
-            {
-              irec.lookup(installed);
-              irec_looked = true;
-              flags = get_flags (irec);
-            }
+            flags = get_version_flags (installed);
           if (flags & pkgflag_system_update)
             {
-              if (ssu_packages_needs_refresh)
+              if (collect_ssu_pkgs)
                 {
                   /* Add it to the local GSList */
                   ssu_pkgs_found = g_slist_prepend (ssu_pkgs_found,
@@ -3011,29 +5332,10 @@ cmd_get_package_list ()
       else
 	encode_empty_version_info (false);
 
-      if (flags == 0 && !cend && !crec_looked)
-	{
-	  crec.lookup(candidate);
-	  flags = get_flags (crec);
-	}
       response.encode_int (flags);
     }
 
-  /* Update the global GArray, if needed */
-  if (ssu_packages_needs_refresh)
-    {
-      ssu_packages_set (ssu_pkgs_found);
-
-      if (ssu_pkgs_found != NULL)
-        {
-          /* Free local GSList */
-          g_slist_free (ssu_pkgs_found);
-          ssu_pkgs_found = NULL;
-        }
-
-      /* Update global flag */
-      ssu_packages_needs_refresh = false;
-    }
+  delete search;
 
   if (show_magic_sys)
     {
@@ -3062,6 +5364,26 @@ cmd_get_package_list ()
       response.encode_string ("Updates to all system packages");
       response.encode_string (NULL);
     }
+
+  if (pattern == NULL)
+    save_package_list_snapshot (snapshot_params, ssu_pkgs_found);
+
+  /* Update the global GArray, if needed */
+  if (ssu_packages_needs_refresh)
+    {
+      ssu_packages_set (ssu_pkgs_found);
+
+      /* Update global flag */
+      ssu_packages_needs_refresh = false;
+    }
+  else
+    {
+      for (GSList *l = ssu_pkgs_found; l; l = l->next)
+	g_free (l->data);
+    }
+
+  /* Free local GSList */
+  g_slist_free (ssu_pkgs_found);
 }
 
 void
@@ -3082,9 +5404,7 @@ cmd_get_system_update_packages ()
       if (installed.end () || candidate.end ())
 	continue;
 
-      package_record rec;
-      rec.lookup(candidate);
-      int flags = get_flags (rec);
+      int flags = get_version_flags (candidate);
       if (flags & pkgflag_system_update)
 	response.encode_string (pkg.Name ());
     }
@@ -3190,7 +5510,101 @@ removable_status ()
 	return status_needed;
     }
 
-  return status_unable;
+  return status_unable;
+}
+
+static void
+clear_package_info (apt_proto_package_info *info)
+{
+  info->installable_status = status_unknown;
+  info->download_size = 0;
+  info->install_user_size_delta = 0;
+  info->required_free_space = 0;
+  info->install_flags = 0;
+  info->removable_status = status_unknown;
+  info->remove_user_size_delta = 0;
+}
+
+/* Fill INFO for PACKAGE by simulating its installation and, unless
+   ONLY_INSTALLABLE_INFO is true, its removal.  The cache must be
+   available.  REC is used for looking up package records and is
+   passed in so that it can be shared between many calls.
+*/
+static void
+get_package_info (package_record &rec,
+		  const char *package, bool only_installable_info,
+		  apt_proto_package_info *info)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  pkgCache::PkgIterator pkg = cache.FindPkg (package);
+
+  clear_package_info (info);
+
+  // simulate install
+
+  mark_named_package_for_install (package);
+  if (any_newly_or_related_broken ())
+    info->installable_status = installable_status ();
+  else
+    info->installable_status = status_able;
+  info->download_size = (int64_t) cache.DebSize ();
+  info->install_user_size_delta = (int64_t) cache.UsrSize ();
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
+       pkg.end() != true;
+       pkg++)
+    {
+      if (is_related (pkg)
+	  && (cache[pkg].Upgrade()
+	      || pkg.State() != pkgCache::PkgIterator::NeedsNothing))
+	{
+	  pkgCache::VerIterator ver = cache[pkg].CandidateVerIter(cache);
+
+	  info->install_flags |= get_version_flags (ver);
+	  info->required_free_space += get_version_required_free_space (ver);
+	}
+    }
+
+  if (only_installable_info)
+    return;
+
+  // simulate remove
+
+  if (!strcmp (package, "magic:sys"))
+    {
+      info->removable_status = status_system_update_unremovable;
+      return;
+    }
+
+  if (!pkg.end())
+    mark_for_remove (pkg);
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
+       pkg.end() != true;
+       pkg++)
+    {
+      if (cache[pkg].Delete())
+	{
+	  pkgCache::VerIterator ver = pkg.CurrentVer ();
+
+	  int flags = get_version_flags (ver);
+	  if (flags & pkgflag_system_update)
+	    {
+	      info->removable_status = status_system_update_unremovable;
+	      break;
+	    }
+	}
+    }
+
+  if (info->removable_status == status_unknown)
+    {
+      if (any_newly_or_related_broken ())
+	info->removable_status = removable_status ();
+      else
+	info->removable_status = status_able;
+    }
+  info->remove_user_size_delta = (int64_t) cache.UsrSize ();
 }
 
 void
@@ -3201,92 +5615,45 @@ cmd_get_package_info ()
 
   apt_proto_package_info info;
 
-  info.installable_status = status_unknown;
-  info.download_size = 0;
-  info.install_user_size_delta = 0;
-  info.required_free_space = 0;
-  info.install_flags = 0;
-  info.removable_status = status_unknown;
-  info.remove_user_size_delta = 0;
+  clear_package_info (&info);
 
   if (ensure_cache (true))
     {
-      AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-      pkgDepCache &cache = *(awc->cache);
-      pkgCache::PkgIterator pkg = cache.FindPkg (package);
       package_record rec;
+      get_package_info (rec, package, only_installable_info, &info);
+    }
 
-      // simulate install
-
-      mark_named_package_for_install (package);
-      if (any_newly_or_related_broken ())
-	info.installable_status = installable_status ();
-      else
-	info.installable_status = status_able;
-      info.download_size = (int64_t) cache.DebSize ();
-      info.install_user_size_delta = (int64_t) cache.UsrSize ();
-
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	   pkg.end() != true;
-	   pkg++)
-	{
-	  if (is_related (pkg)
-	      && (cache[pkg].Upgrade()
-		  || pkg.State() != pkgCache::PkgIterator::NeedsNothing))
-	    {
-	      pkgCache::VerIterator ver = cache[pkg].CandidateVerIter(cache);
+  response.encode_mem (&info, sizeof (apt_proto_package_info));
+}
 
-	      rec.lookup(ver);
-	      info.install_flags |= get_flags (rec);
-	      info.required_free_space += get_required_free_space (rec);
-	    }
-	}
+/* APTCMD_GET_PACKAGE_INFOS
 
-      if (!only_installable_info)
-	{
-	  // simulate remove
+   The batched version of APTCMD_GET_PACKAGE_INFO.  The cache is
+   checked and the package records are opened only once for the whole
+   batch.  Each simulation starts by undoing the marks of the previous
+   one, exactly as with individual requests.
+*/
 
-	  if (!strcmp (package, "magic:sys"))
-	    {
-	      info.removable_status = status_system_update_unremovable;
-	    }
-	  else
-	    {
-	      if (!pkg.end())
-		mark_for_remove (pkg);
+void
+cmd_get_package_infos ()
+{
+  bool only_installable_info = request.decode_int ();
+  bool have_cache = ensure_cache (true);
+  package_record *rec = have_cache? new package_record : NULL;
+  const char *package;
 
-	      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-		   pkg.end() != true;
-		   pkg++)
-		{
-		  if (cache[pkg].Delete())
-		    {
-		      pkgCache::VerIterator ver = pkg.CurrentVer ();
+  while ((package = request.decode_string_in_place ()) != NULL)
+    {
+      apt_proto_package_info info;
 
-		      rec.lookup(ver);
-		      int flags = get_flags (rec);
-		      if (flags & pkgflag_system_update)
-			{
-			  info.removable_status =
-			    status_system_update_unremovable;
-			  break;
-			}
-		    }
-		}
+      clear_package_info (&info);
+      if (have_cache)
+	get_package_info (*rec, package, only_installable_info, &info);
 
-	      if (info.removable_status == status_unknown)
-		{
-		  if (any_newly_or_related_broken ())
-		    info.removable_status = removable_status ();
-		  else
-		    info.removable_status = status_able;
-		}
-	      info.remove_user_size_delta = (int64_t) cache.UsrSize ();
-	    }
-	}
+      response.encode_mem (&info, sizeof (apt_proto_package_info));
     }
 
-  response.encode_mem (&info, sizeof (apt_proto_package_info));
+  delete rec;
 }
 
 /* APTCMD_GET_PACKAGE_DETAILS
@@ -3302,12 +5669,10 @@ append_display_name (GString *str, const pkgCache::PkgIterator &pkg)
   pkgCache::VerIterator ver = pkg.CurrentVer();
   if (!ver.end())
     {
-      package_record rec;
-      rec.lookup(ver);
-      string pretty_name = get_pretty_name (rec);
-      if (!pretty_name.empty())
+      const char *pretty_name = get_version_pretty_name (ver);
+      if (pretty_name)
 	{
-	  g_string_append (str, pretty_name.c_str());
+	  g_string_append (str, pretty_name);
 	  return;
 	}
     }
@@ -3462,7 +5827,7 @@ find_catalogue_by_info (const char* p_uri,
                         const char* p_comp)
 {
   gchar *catname = NULL;
-  xexp *catalogues = read_catalogues ();
+  xexp *catalogues = get_catalogues ();
 
   if (!catalogues)
     return NULL;
@@ -3611,14 +5976,12 @@ encode_package_repository (pkgCache::VerIterator Version, int summary_kind)
 }
 
 void
-encode_package_and_version (const pkgCache::VerIterator ver,
-                            package_record &rec)
+encode_package_and_version (const pkgCache::VerIterator ver)
 {
-  rec.lookup(ver);
   GString *str = g_string_new ("");
-  string pretty = get_pretty_name (rec);
-  if (!pretty.empty())
-    g_string_append (str, pretty.c_str());
+  const char *pretty = get_version_pretty_name (ver);
+  if (pretty)
+    g_string_append (str, pretty);
   else
     g_string_append (str, ver.ParentPkg().Name());
   g_string_append_printf (str, " (%s)", ver.VerStr());
@@ -3631,7 +5994,6 @@ encode_install_summary (const char *want)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  package_record rec;
 
   if (cache.BrokenCount() > 0)
     fprintf (stderr, "[ Some installed packages are broken! ]\n");
@@ -3647,17 +6009,17 @@ encode_install_summary (const char *want)
       if (sc.NewInstall())
 	{
 	  response.encode_int (sumtype_installing);
-	  encode_package_and_version (sc.CandidateVerIter(cache), rec);
+	  encode_package_and_version (sc.CandidateVerIter(cache));
 	}
       else if (sc.Upgrade())
 	{
 	  response.encode_int (sumtype_upgrading);
-	  encode_package_and_version (sc.CandidateVerIter(cache), rec);
+	  encode_package_and_version (sc.CandidateVerIter(cache));
 	}
       else if (sc.Delete())
 	{
 	  response.encode_int (sumtype_removing);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
 
       if (sc.InstBroken())
@@ -3667,7 +6029,7 @@ encode_install_summary (const char *want)
 	  else if (!sc.NowBroken())
 	    {
 	      response.encode_int (sumtype_conflicting);
-	      encode_package_and_version (pkg.CurrentVer(), rec);
+	      encode_package_and_version (pkg.CurrentVer());
 	    }
 	}
     }
@@ -3680,7 +6042,6 @@ encode_remove_summary (pkgCache::PkgIterator &want)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  package_record rec;
 
   if (cache.BrokenCount() > 0)
     log_stderr ("[ Some installed packages are broken! ]\n");
@@ -3696,13 +6057,13 @@ encode_remove_summary (pkgCache::PkgIterator &want)
       if (sc.Delete())
 	{
 	  response.encode_int (sumtype_removing);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
 
       if (sc.InstBroken() && !sc.NowBroken())
 	{
 	  response.encode_int (sumtype_needed_by);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
     }
 
@@ -3784,6 +6145,94 @@ cmd_get_package_details ()
     }
 }
 
+/* APTCMD_GET_ICONS
+
+   The package list only contains the hashes of the icons; the
+   frontend uses this command to get the icons that it doesn't have
+   yet.  An icon is only returned when it still has the requested
+   hash.
+*/
+
+void
+cmd_get_icons ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  const char *package;
+
+  /* Without a cache, we answer nothing at all so that the frontend
+     asks again later.
+  */
+  if (!ensure_cache (true))
+    return;
+
+  package_record *rec = new package_record;
+
+  while ((package = request.decode_string_in_place ()) != NULL)
+    {
+      const char *version = request.decode_string_in_place ();
+      const char *hash = request.decode_string_in_place ();
+      pkgCache::PkgIterator pkg;
+      pkgCache::VerIterator ver;
+      char *icon = NULL;
+
+      if (version && hash
+	  && find_package_version (awc->cache, pkg, ver, package, version))
+	{
+	  rec->lookup (ver);
+	  icon = get_icon (*rec);
+	  if (icon)
+	    {
+	      char *icon_hash = compute_icon_hash (icon);
+	      if (strcmp (icon_hash, hash))
+		{
+		  g_free (icon);
+		  icon = NULL;
+		}
+	      g_free (icon_hash);
+	    }
+	}
+
+      response.encode_string (icon);
+      g_free (icon);
+    }
+
+  delete rec;
+}
+
+/* APTCMD_GET_STATS
+ */
+
+void
+cmd_get_stats ()
+{
+  response.encode_int (total_cache_inits);
+  response.encode_int64 (total_cache_init_usecs);
+
+  for (int i = 0; i < stats_ring_count; i++)
+    {
+      int index = ((stats_ring_next - stats_ring_count + i + STATS_RING_SIZE)
+		   % STATS_RING_SIZE);
+      request_stats *st = &stats_ring[index];
+
+      if (st->cmd == STATS_CMD_WARM_UP)
+	response.encode_string ("WARM_UP");
+      else if (st->cmd >= 0 && st->cmd < (int) G_N_ELEMENTS (cmd_names))
+	response.encode_string (cmd_names[st->cmd]);
+      else
+	response.encode_string ("?");
+      response.encode_int64 (st->wall_usecs);
+      response.encode_int64 (st->cpu_usecs);
+      response.encode_int (st->bytes_in);
+      response.encode_int (st->bytes_out);
+      response.encode_int (st->records_looked_up);
+      response.encode_int (st->cache_inits);
+      response.encode_int64 (st->cache_init_usecs);
+      response.encode_int64 (st->download_usecs);
+      response.encode_int64 (st->updates_file_usecs);
+    }
+  response.encode_string (NULL);
+}
+
 /* APTCMD_THIRD_PARTY_POLICY_CHECK
 */
 
@@ -3828,12 +6277,10 @@ cmd_third_party_policy_check ()
     {
       pkgDepCache &cache = *(awc->cache);
       pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter (cache);
-      package_record rec;
-      rec.lookup(candidate);
-      int flags = get_flags (rec);
 
       // skip non available packages and system update meta-packages
-      if (!candidate.end () && !(flags & pkgflag_system_update))
+      if (!candidate.end ()
+	  && !(get_version_flags (candidate) & pkgflag_system_update))
         {
           for (pkgCache::DepIterator Dep = candidate.DependsList ();
                Dep.end () != true;
@@ -4000,41 +6447,215 @@ find_catalogues_for_item_desc (xexp *catalogues, string desc_uri)
   return cat_glist;
 }
 
-static bool
-download_lists (xexp *catalogues_for_report,
-		bool with_status, int *result)
+/* CatalogueDownloadStatus additionally reports the progress of each
+   catalogue separately, as op_updating_catalogue.  The progress is
+   measured in files, since the size of most of them is not known in
+   advance.
+*/
+
+class CatalogueDownloadStatus : public DownloadStatus
 {
-  *result = rescode_failure;
+  xexp *catalogues;
+  int n_catalogues;
+  const char **names;
+  int *last_already, *last_total;
 
-  // Get the source list
-  pkgSourceList List;
-  if (List.ReadMainList () == false)
-    return rescode_failure;
+  /* Maps each item of the fetcher to the list of the indices of its
+     catalogues.  Items are added while the fetcher runs, so this is
+     filled in as they show up.
+  */
+  GHashTable *item_catalogues;
 
-  // Lock the list directory
-  FileFd Lock;
-  if (_config->FindB("Debug::NoLocking",false) == false)
-    {
-      Lock.Fd (ForceLock (_config->FindDir("Dir::State::Lists") + "lock"));
-      if (_error->PendingError () == true)
+  int
+  catalogue_index (xexp *cat)
+  {
+    int i = 0;
+    for (xexp *c = xexp_first (catalogues); c; c = xexp_rest (c), i++)
+      if (c == cat)
+	return i;
+    return -1;
+  }
+
+  GSList *
+  find_item_catalogues (pkgAcquire::Item *item)
+  {
+    gpointer indices;
+
+    if (g_hash_table_lookup_extended (item_catalogues, item, NULL, &indices))
+      return (GSList *) indices;
+
+    GList *cat_glist =
+      find_catalogues_for_item_desc (catalogues, item->DescURI());
+    GSList *index_list = NULL;
+
+    for (GList *iter = cat_glist; iter; iter = g_list_next (iter))
+      {
+	int i = catalogue_index ((xexp *) iter->data);
+	if (i >= 0)
+	  index_list = g_slist_prepend (index_list, GINT_TO_POINTER (i));
+      }
+    g_list_free (cat_glist);
+
+    g_hash_table_insert (item_catalogues, item, index_list);
+    return index_list;
+  }
+
+protected:
+  virtual bool
+  Pulse (pkgAcquire *Owner)
+  {
+    bool keep_going = DownloadStatus::Pulse (Owner);
+    Report (Owner);
+    return keep_going;
+  }
+
+public:
+  CatalogueDownloadStatus (xexp *cats)
+  {
+    catalogues = cats;
+    n_catalogues = cats ? xexp_length (cats) : 0;
+    names = g_new0 (const char *, n_catalogues);
+    last_already = g_new0 (int, n_catalogues);
+    last_total = g_new0 (int, n_catalogues);
+
+    int i = 0;
+    for (xexp *c = cats ? xexp_first (cats) : NULL; c; c = xexp_rest (c), i++)
+      names[i] = catalogue_name (c);
+    item_catalogues = g_hash_table_new_full (NULL, NULL, NULL,
+					     (GDestroyNotify) g_slist_free);
+  }
+
+  ~CatalogueDownloadStatus ()
+  {
+    g_free (names);
+    g_free (last_already);
+    g_free (last_total);
+    g_hash_table_destroy (item_catalogues);
+  }
+
+  /* The lists might be fetched by more than one fetcher, one after
+     the other, see download_lists.  The items of the previous one
+     are gone when the next one starts.
+  */
+  void
+  ForgetItems ()
+  {
+    g_hash_table_remove_all (item_catalogues);
+  }
+
+  void
+  Report (pkgAcquire *Owner)
+  {
+    if (n_catalogues == 0)
+      return;
+
+    int *already = g_new0 (int, n_catalogues);
+    int *total = g_new0 (int, n_catalogues);
+
+    for (pkgAcquire::ItemIterator I = Owner->ItemsBegin();
+	 I != Owner->ItemsEnd(); I++)
+      {
+	bool finished = ((*I)->Status != pkgAcquire::Item::StatIdle
+			 && (*I)->Status != pkgAcquire::Item::StatFetching);
+
+	for (GSList *iter = find_item_catalogues (*I); iter; iter = iter->next)
+	  {
+	    int i = GPOINTER_TO_INT (iter->data);
+
+	    total[i] += 1;
+	    if (finished)
+	      already[i] += 1;
+	  }
+      }
+
+    /* Catalogues that are not fetched by this fetcher keep what has
+       been reported for them last.
+    */
+    for (int i = 0; i < n_catalogues; i++)
+      if (total[i] > 0
+	  && (already[i] != last_already[i] || total[i] != last_total[i]))
 	{
-	  _error->Error ("Unable to lock the list directory");
-	  return false;
+	  send_catalogue_status (i, names[i], already[i], total[i]);
+	  last_already[i] = already[i];
+	  last_total[i] = total[i];
 	}
-    }
-   
-  // Create the download object
-  DownloadStatus Stat;
-  pkgAcquire Fetcher (with_status ? &Stat : NULL);
 
-  // Populate it with the source selection
-  if (List.GetIndexes(&Fetcher) == false)
-    return false;
-   
-  // Run it
-  if (Fetcher.Run() != pkgAcquire::Continue)
-    return false;
+    g_free (already);
+    g_free (total);
+  }
+};
+
+/* Set up the queues of libapt-pkg for downloading the lists.
+
+   With "HAM::Update::Parallel" true, the default, every host gets its
+   own queue, so that a slow mirror does not hold up the others.
+   There is one connection per host.  Libapt-pkg itself has no limit
+   on the number of hosts that are contacted at the same time, so we
+   fetch the lists of at most "HAM::Update::Max-Hosts" hosts at a
+   time, 4 by default, see download_lists.  Zero means no limit.
+
+   With "HAM::Update::Parallel" false, all lists are fetched through a
+   single queue per access method, one after the other.
+
+   Also, "HAM::Update::PDiffs" decides whether Packages files are
+   updated by fetching only the diffs against the ones we already
+   have, if the repository offers them.  This is on by default.  Note
+   that libapt-pkg only uses diffs for repositories with a signed
+   Release file.
+
+   Lists that we already have are only downloaded again when they
+   have been modified on the server since, see update_package_cache.
+
+   The global configuration is changed only while the lists are
+   downloaded.  Libapt-pkg reads "Acquire::PDiffs" while the fetcher
+   runs, so restore_list_queues must only be called after that.
+*/
+
+struct list_queue_config {
+  string queue_mode;
+  string pdiffs;
+};
+
+static void
+setup_list_queues (list_queue_config *saved)
+{
+  saved->queue_mode = _config->Find ("Acquire::Queue-Mode");
+  saved->pdiffs = _config->Find ("Acquire::PDiffs");
+
+  _config->Set ("Acquire::PDiffs",
+		_config->FindB ("HAM::Update::PDiffs", true) ? "true" : "false");
+  _config->Set ("Acquire::Queue-Mode",
+		_config->FindB ("HAM::Update::Parallel", true)
+		? "host" : "access");
+}
+
+static void
+restore_list_queues (list_queue_config *saved)
+{
+  _config->Set ("Acquire::Queue-Mode", saved->queue_mode);
+  _config->Set ("Acquire::PDiffs", saved->pdiffs);
+}
 
+/* Return the number of hosts whose lists are fetched at the same
+   time, or zero for all of them.
+*/
+static int
+list_hosts_per_run ()
+{
+  if (!_config->FindB ("HAM::Update::Parallel", true))
+    return 0;
+
+  int max_hosts = _config->FindI ("HAM::Update::Max-Hosts", 4);
+  return max_hosts > 0 ? max_hosts : 0;
+}
+
+/* Add the errors of the items of FETCHER that have not been fetched
+   to their catalogues in CATALOGUES_FOR_REPORT.  Return whether
+   there were any.
+*/
+static bool
+report_failed_items (pkgAcquire &Fetcher, xexp *catalogues_for_report)
+{
   bool some_failed = false;
   for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
        I != Fetcher.ItemsEnd(); I++)
@@ -4076,12 +6697,150 @@ download_lists (xexp *catalogues_for_report,
       some_failed = true;
     }
 
+  return some_failed;
+}
+
+/* Remove the files in DIR that don't belong to any of the items that
+   have been fetched, like pkgAcquire::Clean does for a single
+   fetcher.  KEPT contains the file names of the items, without their
+   directory.
+*/
+static void
+clean_list_dir (string dir, GHashTable *kept)
+{
+  DIR *d = opendir (dir.c_str ());
+  if (d == NULL)
+    {
+      log_stderr ("%s: %m", dir.c_str ());
+      return;
+    }
+
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    {
+      if (strcmp (e->d_name, "lock") == 0
+	  || strcmp (e->d_name, "partial") == 0
+	  || strcmp (e->d_name, ".") == 0
+	  || strcmp (e->d_name, "..") == 0
+	  || g_hash_table_lookup (kept, e->d_name))
+	continue;
+
+      unlink ((dir + e->d_name).c_str ());
+    }
+
+  closedir (d);
+}
+
+/* The lists are fetched host by host, in runs of at most
+   list_hosts_per_run hosts.  The hosts are taken in the order in
+   which they first appear in the sources.
+*/
+static bool
+download_lists (xexp *catalogues_for_report,
+		bool with_status, int *result)
+{
+  *result = rescode_failure;
+
+  // Get the source list
+  pkgSourceList List;
+  if (List.ReadMainList () == false)
+    return rescode_failure;
+
+  // Lock the list directory
+  FileFd Lock;
+  if (_config->FindB("Debug::NoLocking",false) == false)
+    {
+      Lock.Fd (ForceLock (_config->FindDir("Dir::State::Lists") + "lock"));
+      if (_error->PendingError () == true)
+	{
+	  _error->Error ("Unable to lock the list directory");
+	  return false;
+	}
+    }
+
+  // Number the hosts
+  GHashTable *host_numbers = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    g_free, NULL);
+  int n_hosts = 0;
+  for (pkgSourceList::const_iterator I = List.begin(); I != List.end(); I++)
+    {
+      string host = ::URI ((*I)->GetURI ()).Host;
+      if (!g_hash_table_lookup_extended (host_numbers, host.c_str (),
+					 NULL, NULL))
+	g_hash_table_insert (host_numbers, g_strdup (host.c_str ()),
+			     GINT_TO_POINTER (n_hosts++));
+    }
+
+  int hosts_per_run = list_hosts_per_run ();
+  if (hosts_per_run == 0 || hosts_per_run > n_hosts)
+    hosts_per_run = MAX (n_hosts, 1);
+
+  list_queue_config saved_config;
+  setup_list_queues (&saved_config);
+  CatalogueDownloadStatus Stat (catalogues_for_report);
+  GHashTable *kept = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, NULL);
+  bool some_failed = false;
+  bool completed = true;
+
+  for (int first = 0; completed && first < MAX (n_hosts, 1);
+       first += hosts_per_run)
+    {
+      // Create the download object
+      Stat.ForgetItems ();
+      pkgAcquire Fetcher (with_status ? &Stat : NULL);
+
+      // Populate it with the sources of the hosts of this run
+      bool populated = true;
+      for (pkgSourceList::const_iterator I = List.begin();
+	   populated && I != List.end(); I++)
+	{
+	  string host = ::URI ((*I)->GetURI ()).Host;
+	  int n = GPOINTER_TO_INT (g_hash_table_lookup (host_numbers,
+							host.c_str ()));
+	  if (n >= first && n < first + hosts_per_run)
+	    populated = (*I)->GetIndexes (&Fetcher, false);
+	}
+
+      if (!populated)
+	{
+	  completed = false;
+	  break;
+	}
+
+      // Run it
+      completed = (Fetcher.Run() == pkgAcquire::Continue);
+      if (with_status)
+	Stat.Report (&Fetcher);
+      if (!completed)
+	break;
+
+      if (report_failed_items (Fetcher, catalogues_for_report))
+	some_failed = true;
+
+      for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
+	   I != Fetcher.ItemsEnd(); I++)
+	{
+	  string name = flNotDir ((*I)->DestFile);
+	  g_hash_table_replace (kept, g_strdup (name.c_str ()),
+				GINT_TO_POINTER (1));
+	}
+    }
+
+  restore_list_queues (&saved_config);
+  g_hash_table_destroy (host_numbers);
+
   // Clean out any old list files
-  if (_config->FindB("APT::Get::List-Cleanup",true) == true)
+  if (completed && _config->FindB("APT::Get::List-Cleanup",true) == true)
     {
-      Fetcher.Clean (_config->FindDir("Dir::State::lists"));
-      Fetcher.Clean (_config->FindDir("Dir::State::lists") + "partial/");
+      clean_list_dir (_config->FindDir("Dir::State::lists"), kept);
+      clean_list_dir (_config->FindDir("Dir::State::lists") + "partial/",
+		      kept);
     }
+  g_hash_table_destroy (kept);
+
+  if (!completed)
+    return false;
 
   if (some_failed)
     *result = rescode_partial_success;
@@ -4137,6 +6896,156 @@ duplink_file_tree (const char *old_tree, const char *new_tree)
   return nftw (old_tree, duplink_callback, 10, 0);
 }
 
+/* Check whether the regular files in the directory hierarchy at
+   NEW_TREE have the same content as the ones at OLD_TREE.  Files that
+   are still the hard links made by duplink_file_tree are the same
+   without looking at them, files that have been downloaded again are
+   compared by their size and their SHA1 sum.  The "partial" directory
+   is ignored.
+*/
+
+static string
+file_sha1 (const char *name, off_t size)
+{
+  int fd = open (name, O_RDONLY);
+  if (fd < 0)
+    return "";
+
+  SHA1Summation SHA1;
+  bool ok = SHA1.AddFD (fd, size);
+  close (fd);
+
+  return ok ? string (SHA1.Result()) : "";
+}
+
+static int sametree_base;
+static const char *sametree_other;
+static bool sametree_compare;
+
+/* The files of the old tree that have been downloaded again with the
+   same content, and the modification times of the new copies.
+*/
+struct refetched_file {
+  char *name;
+  time_t mtime;
+};
+
+static GSList *sametree_refetched;
+
+int
+sametree_callback (const char *name, const struct stat *buf, int m,
+		   struct FTW *f)
+{
+  const char *rel = name + sametree_base;
+  struct stat other_buf;
+
+  if (m != FTW_F
+      || g_str_has_prefix (rel, "/partial/"))
+    return 0;
+
+  char *other_name = g_strdup_printf ("%s%s", sametree_other, rel);
+  int res = lstat (other_name, &other_buf);
+
+  if (res < 0
+      || (sametree_compare && other_buf.st_size != buf->st_size))
+    {
+      g_free (other_name);
+      return 1;
+    }
+
+  if (sametree_compare
+      && (other_buf.st_dev != buf->st_dev
+	  || other_buf.st_ino != buf->st_ino))
+    {
+      string sum = file_sha1 (name, buf->st_size);
+      if (sum.empty ()
+	  || sum != file_sha1 (other_name, buf->st_size))
+	{
+	  g_free (other_name);
+	  return 1;
+	}
+
+      if (other_buf.st_mtime != buf->st_mtime)
+	{
+	  refetched_file *r = new refetched_file;
+	  r->name = other_name;
+	  r->mtime = buf->st_mtime;
+	  sametree_refetched = g_slist_prepend (sametree_refetched, r);
+	  return 0;
+	}
+    }
+
+  g_free (other_name);
+  return 0;
+}
+
+static void
+free_refetched_files ()
+{
+  for (GSList *l = sametree_refetched; l; l = l->next)
+    {
+      refetched_file *r = (refetched_file *)l->data;
+      g_free (r->name);
+      delete r;
+    }
+  g_slist_free (sametree_refetched);
+  sametree_refetched = NULL;
+}
+
+/* Give the files of the old tree that have been downloaded again the
+   modification times of their new copies.  Apt uses these times for
+   If-Modified-Since, and without this, a server that has published
+   the same lists again would send all of them again every time.
+   Return true if any file has been touched.
+*/
+static bool
+touch_refetched_files ()
+{
+  bool touched = false;
+
+  for (GSList *l = sametree_refetched; l; l = l->next)
+    {
+      refetched_file *r = (refetched_file *)l->data;
+      struct stat buf;
+      struct utimbuf times;
+
+      if (stat (r->name, &buf) < 0)
+	continue;
+
+      times.actime = buf.st_atime;
+      times.modtime = r->mtime;
+      if (utime (r->name, &times) < 0)
+	log_stderr ("%s: %m", r->name);
+      else
+	touched = true;
+    }
+
+  free_refetched_files ();
+  return touched;
+}
+
+static bool
+same_file_tree (const char *old_tree, const char *new_tree)
+{
+  free_refetched_files ();
+
+  sametree_base = strlen (new_tree);
+  sametree_other = old_tree;
+  sametree_compare = true;
+  if (nftw (new_tree, sametree_callback, 10, FTW_PHYS) != 0)
+    return false;
+
+  /* Now only check that no file has disappeared.
+   */
+  sametree_base = strlen (old_tree);
+  sametree_other = new_tree;
+  sametree_compare = false;
+  if (nftw (old_tree, sametree_callback, 10, FTW_PHYS) != 0)
+    return false;
+
+  return true;
+}
+
 /* Unlink a directory hirarchy.
  */
 
@@ -4196,9 +7105,35 @@ update_package_cache (xexp *catalogues_for_report,
   duplink_file_tree (lists_dir.c_str(), lists_dir_new.c_str());
   _config->Set ("Dir::State::Lists", lists_dir_new);
 
-  if (download_lists (catalogues_for_report, 
-		      with_status, &result))
+  int64_t download_start = wall_usecs ();
+  bool downloaded = download_lists (catalogues_for_report,
+				    with_status, &result);
+  current_stats.download_usecs += wall_usecs () - download_start;
+
+  if (downloaded
+      && AptWorkerCache::GetCurrent ()->cache != NULL
+      && same_file_tree (lists_dir.c_str(), lists_dir_new.c_str()))
+    {
+      /* Nothing has changed on the servers.  Keep the old lists, the
+	 cache built from them, and the available updates file.
+
+	 The lists that have been downloaded again with the same
+	 content get their new modification times so that the next
+	 check does not download them once more.  The cache on disk
+	 refers to the old times and will be rebuilt when it is opened
+	 next, but the cache in memory stays valid until then.
+      */
+      if (touch_refetched_files ())
+	DBG ("Lists have been published again without changes");
+      _config->Set ("Dir::State::Lists", lists_val);
+      unlink_file_tree (lists_dir_new.c_str());
+    }
+  else if (downloaded)
     {
+      /* The query service still reads the old lists.
+       */
+      stop_query_service ();
+
       /* complete transaction */
       unlink_file_tree (lists_dir_old.c_str());
       rename (lists_dir.c_str(), lists_dir_old.c_str());
@@ -4238,7 +7173,9 @@ update_sources_list (xexp *catalogues)
 
   /* Write the new sources list to disk */
   success = (write_user_catalogues (catalogues)
-	     && write_sources_list (CATALOGUE_APT_SOURCE, catalogues));
+	     && write_sources_list (config_file (CATALOGUE_APT_SOURCE),
+				    catalogues));
+  note_own_sources_change ();
 
   return success;
 }
@@ -4248,8 +7185,11 @@ add_temp_sources_list (xexp *tempcat)
 {
   gboolean success;
 
-  success = (xexp_write_file (TEMP_CATALOGUE_CONF, tempcat) &&
-             write_sources_list (TEMP_APT_SOURCE_LIST, tempcat));
+  success = (xexp_write_file (config_file (TEMP_CATALOGUE_CONF),
+			     tempcat) &&
+             write_sources_list (config_file (TEMP_APT_SOURCE_LIST),
+				 tempcat));
+  note_own_sources_change ();
 
   return success;
 }
@@ -4257,7 +7197,7 @@ add_temp_sources_list (xexp *tempcat)
 int
 cmd_check_updates (bool with_status)
 {
-  xexp *catalogues = read_catalogues ();
+  xexp *catalogues = get_catalogues ();
 
   reset_catalogue_errors (catalogues);
 
@@ -4396,7 +7336,7 @@ append_system_source_dir (xexp *catalogues, string Dir)
 	 continue;
 
        // skip our own file
-       if (File == CATALOGUE_APT_SOURCE)
+       if (File == config_file (CATALOGUE_APT_SOURCE))
 	 continue;
 
        List.push_back(File);      
@@ -4418,11 +7358,11 @@ cmd_get_catalogues ()
   xexp *catalogues = NULL;
 
   /* Check if there are problems reading the file */
-  stat_result = stat (CATALOGUE_CONF, &buf);
+  stat_result = stat (config_file (CATALOGUE_CONF), &buf);
   if (!stat_result)
     {
       /* Map the catalogue report to (maybe) delete error reports from it */
-      xexp *tmp_catalogues = read_catalogues ();
+      xexp *tmp_catalogues = get_catalogues ();
       catalogues = xexp_list_map (tmp_catalogues, map_catalogue_error_details);
       xexp_free (tmp_catalogues);
 
@@ -4432,8 +7372,9 @@ cmd_get_catalogues ()
   else
     {
       /* If there's not a conf file on disk, write a empty one */
-      catalogues = read_catalogues (); /* @check test this scenario */
-      write_user_catalogues (catalogues);
+      catalogues = get_catalogues (); /* @check test this scenario */
+      if (!is_query_child)
+	write_user_catalogues (catalogues);
     }
 
   string Main = _config->FindFile("Dir::Etc::sourcelist");
@@ -4923,7 +7864,7 @@ cmd_install_package ()
 	result_code = rescode_packages_not_found;
     }
 
-  need_cache_init ();
+  need_cache_refresh ();
   response.encode_int (result_code);
 }
 
@@ -4974,7 +7915,7 @@ cmd_remove_package ()
 	}
     }
 
-  need_cache_init ();
+  need_cache_refresh ();
   response.encode_int (result_code == rescode_success);
 }
 
@@ -4996,6 +7937,7 @@ cmd_autoremove ()
           if (Pkg.CurrentVer () != 0 || cache[Pkg].Install ())
             log_stderr ("We could delete %s",  string (Pkg.Name ()).c_str ());
 
+          awc->cache->mark_dirty (Pkg);
           if (Pkg.CurrentVer () != 0 &&
               Pkg->CurrentState != pkgCache::State::ConfigFiles)
             cache.MarkDelete (Pkg, false);
@@ -5016,7 +7958,7 @@ cmd_autoremove ()
      }
 
   result_code = operation (false, NULL, false);
-  need_cache_init ();
+  need_cache_refresh ();
   response.encode_int (result_code == rescode_success);
 }
 
@@ -5058,50 +8000,91 @@ cmd_autoremove ()
    default domain, which they usually are.
 */
 
+/* Finding the domain of a index file is expensive: we need to find
+   the meta index it belongs to among all the sources, and then read
+   the key from the Release.gpg.info file of that meta index.  Since
+   GET_DOMAIN is called for every candidate version during an
+   operation, the results are remembered.
+
+   SET_SOURCES_FOR_GET_DOMAIN builds a table from index files to their
+   meta indices in one go, and the domain of each index file is
+   remembered for as long as the same sources and domain configuration
+   are in use.  The keys of the meta indices are remembered across
+   sources, for as long as their Release.gpg.info file does not
+   change.
+*/
+
 static pkgSourceList *cur_sources;
+static GHashTable *cur_meta_indices = NULL;
+static GHashTable *cur_index_domains = NULL;
+static int cur_index_domains_generation;
+
+struct meta_info_key {
+  time_t mtime;
+  off_t size;
+  char *key;
+};
+
+static GHashTable *meta_info_keys = NULL;
 
 static void
 set_sources_for_get_domain (pkgSourceList *sources)
 {
-  cur_sources = sources;
-}
+  if (cur_meta_indices)
+    {
+      g_hash_table_destroy (cur_meta_indices);
+      cur_meta_indices = NULL;
+    }
+  if (cur_index_domains)
+    {
+      g_hash_table_destroy (cur_index_domains);
+      cur_index_domains = NULL;
+    }
 
-static debReleaseIndex *
-find_deb_meta_index (pkgIndexFile *index)
-{
+  cur_sources = sources;
   if (cur_sources == NULL)
-    return NULL;
+    return;
+
+  cur_meta_indices = g_hash_table_new (NULL, NULL);
+  cur_index_domains = g_hash_table_new (NULL, NULL);
+  cur_index_domains_generation = domains_generation;
 
   for (pkgSourceList::const_iterator I = cur_sources->begin();
        I != cur_sources->end(); I++)
     {
+      bool is_deb = (strcmp ((*I)->GetType(), "deb") == 0);
       vector<pkgIndexFile *> *Indexes = (*I)->GetIndexFiles();
       for (vector<pkgIndexFile *>::const_iterator J = Indexes->begin();
 	   J != Indexes->end(); J++)
 	{
-	  if ((*J) == index)
-	    {
-	      if (strcmp ((*I)->GetType(), "deb") == 0)
-		return (debReleaseIndex *)(*I);
-	      else
-		return NULL;
-	    }
+	  /* The first meta index that has a index file wins.
+	   */
+	  if (!g_hash_table_lookup_extended (cur_meta_indices, *J,
+					     NULL, NULL))
+	    g_hash_table_insert (cur_meta_indices, *J,
+				 is_deb ? (gpointer) *I : NULL);
 	}
     }
-  
-  return NULL;
+}
+
+static debReleaseIndex *
+find_deb_meta_index (pkgIndexFile *index)
+{
+  if (cur_meta_indices == NULL)
+    return NULL;
+
+  return (debReleaseIndex *) g_hash_table_lookup (cur_meta_indices, index);
 }
 
 #define VALIDSIG "VALIDSIG"
 #define GOODSIG  "GOODSIG"
 
 static char *
-get_meta_info_key (debReleaseIndex *meta)
+read_meta_info_key (const char *file)
 {
-  string file = meta->MetaIndexFile ("Release.gpg.info");
   char *key = NULL;
 
-  FILE *f = fopen (file.c_str(), "r");
+  FILE *f = fopen (file, "r");
   if (f)
     {
       char *line = NULL;
@@ -5129,8 +8112,49 @@ get_meta_info_key (debReleaseIndex *meta)
   return key;
 }
 
+static void
+free_meta_info_key (gpointer data)
+{
+  meta_info_key *k = (meta_info_key *)data;
+  g_free (k->key);
+  delete k;
+}
+
+/* Return the key of META.  The returned string is owned by the
+   META_INFO_KEYS table.
+*/
+static const char *
+get_meta_info_key (debReleaseIndex *meta)
+{
+  string file = meta->MetaIndexFile ("Release.gpg.info");
+  struct stat buf;
+
+  if (meta_info_keys == NULL)
+    meta_info_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, free_meta_info_key);
+
+  if (stat (file.c_str(), &buf) < 0)
+    {
+      g_hash_table_remove (meta_info_keys, file.c_str());
+      return NULL;
+    }
+
+  meta_info_key *k =
+    (meta_info_key *) g_hash_table_lookup (meta_info_keys, file.c_str());
+  if (k && k->mtime == buf.st_mtime && k->size == buf.st_size)
+    return k->key;
+
+  k = new meta_info_key;
+  k->mtime = buf.st_mtime;
+  k->size = buf.st_size;
+  k->key = read_meta_info_key (file.c_str());
+  g_hash_table_replace (meta_info_keys, g_strdup (file.c_str()), k);
+
+  return k->key;
+}
+
 static int
-get_domain (pkgIndexFile *index)
+compute_domain (pkgIndexFile *index)
 {
   if (index->IsTrusted ())
     {
@@ -5141,13 +8165,9 @@ get_domain (pkgIndexFile *index)
 	  if (d != DOMAIN_SIGNED)
 	    return d;
 
-	  char *key = get_meta_info_key (meta);
+	  const char *key = get_meta_info_key (meta);
 	  if (key)
-	    {
-	      domain_t d = find_domain_by_key (key);
-	      g_free (key);
-	      return d;
-	    }
+	    return find_domain_by_key (key);
 	}
 
       return DOMAIN_SIGNED;
@@ -5156,6 +8176,28 @@ get_domain (pkgIndexFile *index)
     return DOMAIN_UNSIGNED;
 }
 
+static int
+get_domain (pkgIndexFile *index)
+{
+  gpointer val;
+
+  if (cur_index_domains == NULL)
+    return compute_domain (index);
+
+  if (cur_index_domains_generation != domains_generation)
+    {
+      g_hash_table_remove_all (cur_index_domains);
+      cur_index_domains_generation = domains_generation;
+    }
+
+  if (g_hash_table_lookup_extended (cur_index_domains, index, NULL, &val))
+    return GPOINTER_TO_INT (val);
+
+  int d = compute_domain (index);
+  g_hash_table_insert (cur_index_domains, index, GINT_TO_POINTER (d));
+  return d;
+}
+
 static bool
 domain_dominates_or_is_equal (int a, int b)
 {
@@ -5186,6 +8228,8 @@ collect_new_domains ()
     if (awc->cache->extra_info[i].related)
       awc->cache->extra_info[i].cur_domain
         = awc->cache->extra_info[i].new_domain;
+
+  awc->cache->extra_info_saved = false;
 }
 
 static int
@@ -5373,80 +8417,208 @@ myDPkgPM::CreateOrderList ()
   return true;
 }
 
+/* Verifying downloaded packages.
+
+   The checksums of the downloaded packages are computed by a small
+   pool of threads, since that is mostly waiting for the disk and, on
+   machines with more than one core, the computing can be spread over
+   them as well.  The threads only touch the files and the summation
+   objects; everything else, such as looking up the expected sums in
+   the package records, happens in the main thread before and after.
+
+   Files that have passed are remembered, together with their size,
+   inode number and change time, so that they don't need to be
+   verified again when the operation is retried.  The modification
+   time is not good enough since it comes from the server.  Files that
+   could not be checked at all are not remembered.
+*/
+
+enum verify_kind {
+  verify_sha256,
+  verify_sha1,
+  verify_md5
+};
+
+struct verify_job {
+  string file;
+  string expected;
+  verify_kind kind;
+  char *memo_key;
+  bool checked;
+  bool ok;
+};
+
+static GHashTable *verified_files = NULL;
+
+static char *
+verify_memo_key (verify_job *job, struct stat *buf)
+{
+  return g_strdup_printf ("%s %s %ld %ld %ld",
+			  job->file.c_str(), job->expected.c_str(),
+			  (long) buf->st_size, (long) buf->st_ino,
+			  (long) buf->st_ctime);
+}
+
+static void
+verify_package_file (gpointer data, gpointer unused)
+{
+  verify_job *job = (verify_job *)data;
+  struct stat buf;
+  string sum;
+
+  int fd = open (job->file.c_str(), O_RDONLY);
+  if (fd < 0 || fstat (fd, &buf) < 0)
+    {
+      /* Not being able to check a file is not the same as finding
+	 it corrupted; dpkg will complain if it can't read it.
+      */
+      if (fd >= 0)
+	close (fd);
+      job->ok = true;
+      return;
+    }
+
+  switch (job->kind)
+    {
+    case verify_sha256:
+      {
+	SHA256Summation SHA256;
+	SHA256.AddFD (fd, buf.st_size);
+	sum = string (SHA256.Result());
+	break;
+      }
+    case verify_sha1:
+      {
+	SHA1Summation SHA1;
+	SHA1.AddFD (fd, buf.st_size);
+	sum = string (SHA1.Result());
+	break;
+      }
+    case verify_md5:
+      {
+	MD5Summation MD5;
+	MD5.AddFD (fd, buf.st_size);
+	sum = string (MD5.Result());
+	break;
+      }
+    }
+
+  close (fd);
+  job->ok = (sum == job->expected);
+  job->checked = true;
+
+  /* Remember the file as it was when we read it.
+   */
+  g_free (job->memo_key);
+  job->memo_key = verify_memo_key (job, &buf);
+}
+
+static int
+verify_thread_count ()
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  return CLAMP (n, 2, 4);
+}
+
 bool
 myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
 {
   bool result = true;
   package_record rec;
+  GPtrArray *jobs = g_ptr_array_new ();
+
+  if (verified_files == NULL)
+    verified_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, NULL);
 
   for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
        I != pkgPackageManager::List->end(); I++)
     {
-      bool partial_result = true;
       PkgIterator Pkg(Cache,*I);
       pkgCache::VerIterator cand_ver = Cache[Pkg].CandidateVerIter(Cache);
 
-      rec.lookup(cand_ver);
       string File = FileNames[Pkg->ID];
       if (File.empty())
         continue;
-      FileFd Fd (File, FileFd::ReadOnly);
-      if (_error->PendingError() == true) // return false?
-        continue;
 
-      string ExpectedSHA256 = rec.get_string("SHA256");
+      rec.lookup(cand_ver);
 
-      if (!ExpectedSHA256.empty())
-        {
-          SHA256Summation SHA256;
-          SHA256.AddFD(Fd.Fd(), Fd.Size());
-          string file_sha256 = string(SHA256.Result());
+      verify_job *job = new verify_job;
+      job->file = File;
+      job->checked = false;
+      job->ok = true;
+
+      if (!(job->expected = rec.get_string("SHA256")).empty())
+	job->kind = verify_sha256;
+      else if (!(job->expected = rec.get_string("SHA1")).empty())
+	job->kind = verify_sha1;
+      else if (!(job->expected = rec.get_string("MD5sum")).empty())
+	job->kind = verify_md5;
+      else
+	{
+	  delete job;
+	  continue;
+	}
 
-          if (file_sha256 != ExpectedSHA256)
-            {
-              log_stderr ("File %s is corrupted (SHA256).", File.c_str());
-              partial_result = false;
-            }
-        }
+      struct stat buf;
+      if (stat (File.c_str(), &buf) < 0)
+	{
+	  delete job;
+	  continue;
+	}
+
+      job->memo_key = verify_memo_key (job, &buf);
+      if (g_hash_table_lookup (verified_files, job->memo_key))
+	{
+	  g_free (job->memo_key);
+	  delete job;
+	  continue;
+	}
+
+      g_ptr_array_add (jobs, job);
+    }
+
+  GThreadPool *pool = NULL;
+  if (jobs->len > 1 && g_thread_supported ())
+    pool = g_thread_pool_new (verify_package_file, NULL,
+			      verify_thread_count (), TRUE, NULL);
+
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      if (pool)
+	g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
       else
-        {
-          string ExpectedSHA1 = rec.get_string("SHA1");
+	verify_package_file (g_ptr_array_index (jobs, i), NULL);
+    }
 
-          if (!ExpectedSHA1.empty())
-            {
-              SHA1Summation SHA1;
-              SHA1.AddFD(Fd.Fd(), Fd.Size());
-              string file_sha1 = string(SHA1.Result());
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
 
-              if (file_sha1 != ExpectedSHA1)
-                {
-                  log_stderr ("File %s is corrupted (SHA1).", File.c_str());
-                  partial_result = false;
-                }
-            }
-          else
-            {
-              string ExpectedMD5 = rec.get_string("MD5sum");
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      verify_job *job = (verify_job *) g_ptr_array_index (jobs, i);
 
-              if (!ExpectedMD5.empty())
-                {
-                  MD5Summation sum;
-                  sum.AddFD (Fd.Fd(), Fd.Size());
-                  string MD5 = (string)sum.Result();
+      if (job->ok && job->checked)
+	{
+	  g_hash_table_insert (verified_files, job->memo_key, (gpointer) 1);
+	  job->memo_key = NULL;
+	}
+      else if (!job->ok)
+	{
+	  log_stderr ("File %s is corrupted (%s).", job->file.c_str(),
+		      (job->kind == verify_sha256
+		       ? "SHA256"
+		       : (job->kind == verify_sha1 ? "SHA1" : "MD5sum")));
+	  result = false;
+	  if (clean_corrupted)
+	    unlink (job->file.c_str());
+	}
 
-                  if (MD5 != ExpectedMD5)
-                    {
-                      log_stderr ("File %s is corrupted (MD5sum).", File.c_str());
-                      partial_result = false;
-                    }
-                }
-            }
-        }
-      Fd.Close();
-      result = result && partial_result;
-      if (clean_corrupted && !partial_result)
-        unlink (File.c_str());
+      g_free (job->memo_key);
+      delete job;
     }
+
+  g_ptr_array_free (jobs, TRUE);
   return result;
 }
 
@@ -5535,8 +8707,7 @@ get_pkg_required_free_space ()
         {
           pkgCache::VerIterator ver = cache[pkg].CandidateVerIter (cache);
 
-          rec.lookup(ver);
-          retval += get_required_free_space (rec);
+          retval += get_version_required_free_space (ver);
         }
     }
 
@@ -5592,11 +8763,11 @@ is_there_enough_free_space (const char *archive_dir, int64_t size)
  */
 
 static int
-operation (bool check_only,
-	   const char *alt_download_root,
-	   bool download_only,
-	   bool allow_download,
-	   bool with_status)
+operation_1 (bool check_only,
+	     const char *alt_download_root,
+	     bool download_only,
+	     bool allow_download,
+	     bool with_status)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgCacheFile &Cache = *(awc->cache);
@@ -5790,6 +8961,11 @@ operation (bool check_only,
       // sync before installing
       sync ();
 
+      /* Dpkg rewrites its status file, which the query service
+	 reads its package records from.
+      */
+      stop_query_service ();
+
       /* Do install */
       _system->UnLock();
       pkgPackageManager::OrderResult Res = Pm->DoInstall (status_fd);
@@ -5808,6 +8984,24 @@ operation (bool check_only,
   return rescode_success;
 }
 
+/* operation_1 points get_domain at its own pkgSourceList, which is
+   gone when it returns.  Reset it here, on every way out, as
+   InitDomains does.
+*/
+
+static int
+operation (bool check_only,
+	   const char *alt_download_root,
+	   bool download_only,
+	   bool allow_download,
+	   bool with_status)
+{
+  int result_code = operation_1 (check_only, alt_download_root,
+				 download_only, allow_download, with_status);
+  set_sources_for_get_domain (NULL);
+  return result_code;
+}
+
 /* APTCMD_CLEAN
  */
 
@@ -6293,7 +9487,7 @@ cmd_install_file ()
 
   _system->Lock();
 
-  need_cache_init ();
+  need_cache_refresh ();
   response.encode_int (res == 0);
 }
 
@@ -6345,7 +9539,7 @@ cmd_save_backup_data ()
   xexp *packages = get_backup_packages ();
   if (packages)
     {
-      xexp_write_file (BACKUP_PACKAGES, packages);
+      xexp_write_file (config_file (BACKUP_PACKAGES), packages);
       xexp_free (packages);
     }
 }
@@ -6368,7 +9562,8 @@ save_failed_catalogues (xexp *catalogues)
     }
 
   if (xexp_length (failed_catalogues) > 0)
-    xexp_write_file (FAILED_CATALOGUES_FILE, failed_catalogues);
+    xexp_write_file (config_file (FAILED_CATALOGUES_FILE),
+		     failed_catalogues);
   else
     clean_failed_catalogues ();
 
@@ -6383,10 +9578,11 @@ load_failed_catalogues ()
   xexp *failed_catalogues = NULL;
 
   /* Check if there are problems reading the file */
-  stat_result = stat (FAILED_CATALOGUES_FILE, &buf);
+  stat_result = stat (config_file (FAILED_CATALOGUES_FILE), &buf);
   if (!stat_result)
     {
-      failed_catalogues = xexp_read_file (FAILED_CATALOGUES_FILE);
+      failed_catalogues =
+	xexp_read_file (config_file (FAILED_CATALOGUES_FILE));
       if (xexp_length (failed_catalogues) <= 0)
 	{
 	  /* Return NULL and clean failed catalogues file if there
@@ -6398,7 +9594,8 @@ load_failed_catalogues ()
 	}
     }
   else if (errno != ENOENT)
-    log_stderr ("error reading file %s: %m", FAILED_CATALOGUES_FILE);
+    log_stderr ("error reading file %s: %m",
+		config_file (FAILED_CATALOGUES_FILE));
 
   return failed_catalogues;
 }
@@ -6406,15 +9603,18 @@ load_failed_catalogues ()
 static void
 clean_failed_catalogues ()
 {
-  if (unlink (FAILED_CATALOGUES_FILE) < 0 && errno != ENOENT)
-    log_stderr ("error unlinking %s: %m", FAILED_CATALOGUES_FILE);
+  if (unlink (config_file (FAILED_CATALOGUES_FILE)) < 0 && errno != ENOENT)
+    log_stderr ("error unlinking %s: %m",
+		config_file (FAILED_CATALOGUES_FILE));
 }
 
 static void
 clean_temp_catalogues ()
 {
-  if (unlink (TEMP_APT_SOURCE_LIST) < 0 && errno != ENOENT)
-    log_stderr ("error unlinking %s: %m", TEMP_APT_SOURCE_LIST);
+  const char *temp_source_list = config_file (TEMP_APT_SOURCE_LIST);
+  if (unlink (temp_source_list) < 0 && errno != ENOENT)
+    log_stderr ("error unlinking %s: %m", temp_source_list);
+  note_own_sources_change ();
 }
 
 static void
@@ -6462,15 +9662,11 @@ write_available_updates_file ()
 	{
 	  xexp *x_pkg = NULL;
 
-	  rec.lookup(candidate);
-	  int flags = get_flags (rec);
+	  int flags = get_version_flags (candidate);
 	  int domain_index = awc->cache->extra_info[pkg->ID].cur_domain;
 
-          const char *pkg_name;
-          string pretty_name = get_pretty_name (rec);
-          if (!pretty_name.empty ())
-            pkg_name = pretty_name.c_str ();
-          else
+          const char *pkg_name = get_version_pretty_name (candidate);
+          if (pkg_name == NULL)
             pkg_name = pkg.Name ();
 
 	  if (flags & pkgflag_system_update)
@@ -6484,7 +9680,7 @@ write_available_updates_file ()
 	}
     }
 
-  xexp_write_file (AVAILABLE_UPDATES_FILE, x_updates);
+  xexp_write_file (config_file (AVAILABLE_UPDATES_FILE), x_updates);
 
   if (x_updates)
     xexp_free (x_updates);
@@ -6587,14 +9783,14 @@ save_operation_record (const char *package, const char *download_root)
   xexp *record = xexp_list_new ("install");
   xexp_aset_text (record, "package", package);
   xexp_aset_text (record, "download-root", download_root);
-  xexp_write_file (CURRENT_OPERATION_FILE, record);
+  xexp_write_file (config_file (CURRENT_OPERATION_FILE), record);
   xexp_free (record);
 }
 
 static void
 erase_operation_record ()
 {
-  unlink (CURRENT_OPERATION_FILE);
+  unlink (config_file (CURRENT_OPERATION_FILE));
 }
 
 static xexp *
@@ -6606,10 +9802,10 @@ read_operation_record ()
      complaint from xexp_read_file in the common case that the file
      doesn't exist.
   */
-  if (stat (CURRENT_OPERATION_FILE, &buf))
+  if (stat (config_file (CURRENT_OPERATION_FILE), &buf))
     return NULL;
 
-  return xexp_read_file (CURRENT_OPERATION_FILE);
+  return xexp_read_file (config_file (CURRENT_OPERATION_FILE));
 }
 
 static int
@@ -6932,7 +10128,7 @@ do_rescue (const char *package, const char *download_root,
   result_xexp = xexp_text_new ("success", result_text);
   g_free (result_text);
 
-  xexp_write_file (RESCUE_RESULT_FILE, result_xexp);
+  xexp_write_file (config_file (RESCUE_RESULT_FILE), result_xexp);
   xexp_free (result_xexp);
 }
 
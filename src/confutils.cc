@@ -73,6 +73,42 @@ load_system_settings ()
     default_distribution = "unknown";
 }
 
+/* Configuration root
+ */
+
+static char *config_root = NULL;
+
+void
+set_config_root (const char *root)
+{
+  g_free (config_root);
+  config_root = NULL;
+
+  if (root == NULL)
+    return;
+
+  /* The files all start with a slash already.
+   */
+  int len = strlen (root);
+  while (len > 0 && root[len-1] == '/')
+    len--;
+
+  if (len > 0)
+    config_root = g_strndup (root, len);
+}
+
+const char *
+config_file (const char *file)
+{
+  if (config_root == NULL)
+    return file;
+
+  char *path = g_strconcat (config_root, file, NULL);
+  const char *result = g_intern_string (path);
+  g_free (path);
+  return result;
+}
+
 static const char *
 skip_whitespace (const char *str)
 {
@@ -386,7 +422,7 @@ get_backup_catalogues ()
      by packages.
   */
 
-  return xexp_read_file (CATALOGUE_CONF);
+  return xexp_read_file (config_file (CATALOGUE_CONF));
 }
 
 void
@@ -404,8 +440,8 @@ backup_catalogues ()
   xexp *catalogues = get_backup_catalogues ();
   if (catalogues)
     {
-      xexp_write_file (BACKUP_CATALOGUES, catalogues);
-      xexp_write_file (BACKUP_CATALOGUES2, catalogues);
+      xexp_write_file (config_file (BACKUP_CATALOGUES), catalogues);
+      xexp_write_file (config_file (BACKUP_CATALOGUES2), catalogues);
       xexp_free (catalogues);
     }
 }
@@ -526,7 +562,7 @@ add_user_catalogues (xexp *global)
 {
   g_return_if_fail (global);
 
-  xexp *syscat = xexp_read_file (CATALOGUE_CONF);
+  xexp *syscat = xexp_read_file (config_file (CATALOGUE_CONF));
 
   if (syscat)
     {
@@ -558,7 +594,7 @@ xexp*
 read_catalogues (void)
 {
   xexp* global = xexp_list_new ("catalogues");
-  read_package_config_files (global, PACKAGE_CATALOGUES,
+  read_package_config_files (global, config_file (PACKAGE_CATALOGUES),
 			     add_package_catalogues);
   add_user_catalogues (global);
 
@@ -595,7 +631,7 @@ write_user_catalogues (xexp *catalogues)
 	}
     }
 
-  gint retval = xexp_write_file (CATALOGUE_CONF, usercat);
+  gint retval = xexp_write_file (config_file (CATALOGUE_CONF), usercat);
   xexp_free (usercat);
 
   return retval;
@@ -619,7 +655,7 @@ xexp*
 read_domains (void)
 {
   xexp *global = xexp_list_new ("domains");
-  read_package_config_files (global, PACKAGE_DOMAINS, NULL);
+  read_package_config_files (global, config_file (PACKAGE_DOMAINS), NULL);
 
   return global;
 }
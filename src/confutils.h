@@ -67,6 +67,19 @@ extern "C" {
 #define BACKUP_CATALOGUES2 "/var/lib/hildon-application-manager/catalogues2.backup"
 #define BACKUP_PACKAGES "/var/lib/hildon-application-manager/packages.backup"
 
+/* The catalogue and domain files and directories above, and the
+   files below /var/lib/hildon-application-manager that the
+   apt-worker writes, are looked up below a root directory.  This is
+   "/" unless set_config_root has been called.  The apt-worker sets it
+   to the "Dir" of libapt-pkg, so that APT_CONFIG can point it at a
+   different tree, as apt-worker-bench does.
+
+   CONFIG_FILE returns the name of FILE below that root.  The returned
+   string must not be freed.
+*/
+void set_config_root (const char *root);
+const char *config_file (const char *file);
+
 /* NULL and empty strings are considered equal.  Whitespace at the
    beginning and end is ignored.  Sequences of whitespaces are equal
    to each other.
@@ -0,0 +1,457 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <gtk/gtk.h>
+
+#include "icons.h"
+#include "util.h"
+#include "apt-worker-client.h"
+#include "user_files.h"
+
+#define ICON_CACHE_DIR "icons"
+
+/* The maximum number of decoded icons that are kept in memory.  This
+   should be comfortably larger than the number of rows that fit on
+   the screen.
+*/
+#define MAX_DECODED_ICONS 64
+
+/* The number of icons that are requested with one GET_ICONS command.
+ */
+#define ICON_BATCH_SIZE 32
+
+/* The maximum number of icons that are kept on disk, a few MB.  When
+   there are more, the oldest ones are removed.  This is checked with
+   the first icon that is saved, and after every ICON_PRUNE_INTERVAL
+   more.
+*/
+#define MAX_CACHED_ICONS    1000
+#define ICON_PRUNE_INTERVAL 100
+
+/* The decoded icons, from the most recently to the least recently
+   used one.  DECODED_ICONS maps hashes to the links of ICON_LRU.
+*/
+struct decoded_icon {
+  char *hash;
+  GdkPixbuf *pixbuf;
+};
+
+static GHashTable *decoded_icons = NULL;
+static GQueue icon_lru = G_QUEUE_INIT;
+
+/* The hashes of the icons that have been requested from the
+   apt-worker, and of those that it could not deliver.
+
+   REQUESTED_ICONS maps each hash to the list of the other
+   package_infos that are waiting for the same icon.  MISSING_ICONS is
+   forgotten whenever a new package list arrives, since the icons
+   might be available then.
+*/
+static GHashTable *requested_icons = NULL;
+static GHashTable *missing_icons = NULL;
+
+struct icon_request {
+  package_info *pi;
+  bool installed;
+};
+
+static GSList *queued_requests = NULL;
+static bool fetch_scheduled = false;
+static bool fetch_in_flight = false;
+
+static void fetch_queued_icons ();
+
+static gchar *
+icon_file_name (const char *hash)
+{
+  gchar *dir = user_file_get_state_dir_path ();
+  gchar *file = g_strdup_printf ("%s/" ICON_CACHE_DIR "/%s.png", dir, hash);
+  g_free (dir);
+  return file;
+}
+
+struct cached_icon {
+  time_t mtime;
+  gchar *name;
+};
+
+static int
+compare_cached_icons (const void *a, const void *b)
+{
+  time_t ta = ((const cached_icon *) a)->mtime;
+  time_t tb = ((const cached_icon *) b)->mtime;
+  return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+/* Remove the oldest icons in ICON_DIR so that at most
+   MAX_CACHED_ICONS remain.
+*/
+static void
+prune_icon_cache (const char *icon_dir)
+{
+  GDir *dir = g_dir_open (icon_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  GArray *icons = g_array_new (FALSE, FALSE, sizeof (cached_icon));
+  const char *name;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      struct stat buf;
+      cached_icon c;
+
+      if (!g_str_has_suffix (name, ".png"))
+	continue;
+
+      c.name = g_strdup_printf ("%s/%s", icon_dir, name);
+      if (stat (c.name, &buf) < 0)
+	{
+	  g_free (c.name);
+	  continue;
+	}
+      c.mtime = buf.st_mtime;
+      g_array_append_val (icons, c);
+    }
+  g_dir_close (dir);
+
+  if (icons->len > MAX_CACHED_ICONS)
+    {
+      qsort (icons->data, icons->len, sizeof (cached_icon),
+	     compare_cached_icons);
+      for (guint i = 0; i < icons->len - MAX_CACHED_ICONS; i++)
+	unlink (g_array_index (icons, cached_icon, i).name);
+    }
+
+  for (guint i = 0; i < icons->len; i++)
+    g_free (g_array_index (icons, cached_icon, i).name);
+  g_array_free (icons, TRUE);
+}
+
+static void
+save_icon (const char *hash, GdkPixbuf *icon)
+{
+  static int saved_since_prune = 0;
+
+  gchar *dir = user_file_get_state_dir_path ();
+  gchar *icon_dir = g_strdup_printf ("%s/" ICON_CACHE_DIR, dir);
+  gchar *file = icon_file_name (hash);
+  gchar *tmp = g_strdup_printf ("%s.tmp", file);
+  GError *error = NULL;
+
+  mkdir (icon_dir, 0777);
+  if (saved_since_prune++ % ICON_PRUNE_INTERVAL == 0)
+    prune_icon_cache (icon_dir);
+
+  if (!gdk_pixbuf_save (icon, tmp, "png", &error, NULL)
+      || rename (tmp, file) < 0)
+    {
+      if (error)
+	{
+	  fprintf (stderr, "%s: %s\n", tmp, error->message);
+	  g_error_free (error);
+	}
+      unlink (tmp);
+    }
+
+  g_free (tmp);
+  g_free (file);
+  g_free (icon_dir);
+  g_free (dir);
+}
+
+static void
+ensure_tables ()
+{
+  if (decoded_icons == NULL)
+    {
+      decoded_icons = g_hash_table_new (g_str_hash, g_str_equal);
+      requested_icons = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, NULL);
+      missing_icons = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, NULL);
+    }
+}
+
+/* Put ICON into the memory cache and forget the least recently used
+   icons when there are too many.  The reference to ICON is taken
+   over.
+*/
+static void
+remember_icon (const char *hash, GdkPixbuf *icon)
+{
+  decoded_icon *d = new decoded_icon;
+
+  d->hash = g_strdup (hash);
+  d->pixbuf = icon;
+  g_queue_push_head (&icon_lru, d);
+  g_hash_table_insert (decoded_icons, d->hash, icon_lru.head);
+
+  while (icon_lru.length > MAX_DECODED_ICONS)
+    {
+      d = (decoded_icon *) g_queue_pop_tail (&icon_lru);
+      g_hash_table_remove (decoded_icons, d->hash);
+      g_free (d->hash);
+      g_object_unref (d->pixbuf);
+      delete d;
+    }
+}
+
+/* Return the icon with HASH when it is in memory or on disk, or NULL.
+ */
+static GdkPixbuf *
+lookup_icon (const char *hash)
+{
+  GList *link;
+
+  ensure_tables ();
+
+  link = (GList *) g_hash_table_lookup (decoded_icons, hash);
+  if (link)
+    {
+      g_queue_unlink (&icon_lru, link);
+      g_queue_push_head_link (&icon_lru, link);
+      return ((decoded_icon *) link->data)->pixbuf;
+    }
+
+  gchar *file = icon_file_name (hash);
+  GdkPixbuf *icon = gdk_pixbuf_new_from_file (file, NULL);
+  g_free (file);
+
+  if (icon)
+    remember_icon (hash, icon);
+
+  return icon;
+}
+
+/* The available version is shown with the icon of the installed
+   one when it has none of its own.  That icon must then be requested
+   for the installed version, too.
+*/
+static bool
+request_installed (package_info *pi, bool installed)
+{
+  return installed || pi->available_icon_hash == NULL;
+}
+
+static const char *
+request_hash (package_info *pi, bool installed)
+{
+  if (request_installed (pi, installed))
+    return pi->installed_icon_hash;
+  return pi->available_icon_hash;
+}
+
+static const char *
+request_version (package_info *pi, bool installed)
+{
+  if (request_installed (pi, installed))
+    return pi->installed_version;
+  return pi->available_version;
+}
+
+static gboolean
+fetch_queued_icons_idle (gpointer unused)
+{
+  fetch_scheduled = false;
+  fetch_queued_icons ();
+  return FALSE;
+}
+
+static void
+queue_request (package_info *pi, bool installed)
+{
+  const char *hash = request_hash (pi, installed);
+  gpointer waiting;
+
+  if (g_hash_table_lookup (missing_icons, hash))
+    return;
+
+  if (g_hash_table_lookup_extended (requested_icons, hash, NULL, &waiting))
+    {
+      GSList *waiters = (GSList *) waiting;
+      if (g_slist_find (waiters, pi) == NULL)
+	{
+	  pi->ref ();
+	  g_hash_table_insert (requested_icons, g_strdup (hash),
+			       g_slist_prepend (waiters, pi));
+	}
+      return;
+    }
+
+  icon_request *r = new icon_request;
+  r->pi = pi;
+  r->installed = installed;
+  pi->ref ();
+  queued_requests = g_slist_prepend (queued_requests, r);
+  g_hash_table_insert (requested_icons, g_strdup (hash), NULL);
+
+  /* The icons are requested from an idle handler so that all rows
+     that are drawn together end up in the same batch.
+  */
+  if (!fetch_scheduled)
+    {
+      fetch_scheduled = true;
+      g_idle_add (fetch_queued_icons_idle, NULL);
+    }
+}
+
+GdkPixbuf *
+package_icon (package_info *pi, bool installed)
+{
+  GdkPixbuf *icon = installed ? pi->installed_icon : pi->available_icon;
+  const char *version = (installed
+			 ? pi->installed_version
+			 : pi->available_version);
+  const char *hash;
+
+  if (icon || version == NULL)
+    return icon;
+
+  hash = request_hash (pi, installed);
+  if (hash == NULL)
+    return NULL;
+
+  icon = lookup_icon (hash);
+  if (icon == NULL)
+    queue_request (pi, installed);
+
+  return icon;
+}
+
+struct gi_closure {
+  GSList *requests;
+};
+
+static void
+get_icons_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  gi_closure *c = (gi_closure *)data;
+
+  for (GSList *r = c->requests; r; r = r->next)
+    {
+      icon_request *req = (icon_request *)r->data;
+      const char *hash = request_hash (req->pi, req->installed);
+      GdkPixbuf *icon = NULL;
+      bool answered = false;
+
+      /* The apt-worker answers nothing at all when it can't look for
+	 icons right now.
+      */
+      if (dec && !dec->at_end ())
+	{
+	  const char *base64 = dec->decode_string_in_place ();
+	  if (!dec->corrupted ())
+	    {
+	      answered = true;
+	      icon = pixbuf_from_base64 (base64);
+	    }
+	}
+
+      GSList *waiters =
+	(GSList *) g_hash_table_lookup (requested_icons, hash);
+      g_hash_table_remove (requested_icons, hash);
+
+      if (icon)
+	{
+	  save_icon (hash, icon);
+	  remember_icon (hash, icon);
+	  global_package_info_changed (req->pi);
+	}
+      else if (answered)
+	g_hash_table_insert (missing_icons, g_strdup (hash),
+			     GINT_TO_POINTER (1));
+
+      for (GSList *w = waiters; w; w = w->next)
+	{
+	  package_info *pi = (package_info *) w->data;
+	  if (icon)
+	    global_package_info_changed (pi);
+	  pi->unref ();
+	}
+      g_slist_free (waiters);
+
+      req->pi->unref ();
+      delete req;
+    }
+
+  g_slist_free (c->requests);
+  delete c;
+
+  fetch_in_flight = false;
+  fetch_queued_icons ();
+}
+
+/* Send one GET_ICONS command for the first ICON_BATCH_SIZE icons in
+   the queue.  The next batch is sent when the reply for this one has
+   arrived so that the apt-worker is never busy with icons for a long
+   time.
+*/
+static void
+fetch_queued_icons ()
+{
+  const char *packages[ICON_BATCH_SIZE+1];
+  const char *versions[ICON_BATCH_SIZE];
+  const char *hashes[ICON_BATCH_SIZE];
+  int n = 0;
+
+  if (fetch_in_flight || queued_requests == NULL)
+    return;
+
+  gi_closure *c = new gi_closure;
+  c->requests = NULL;
+
+  queued_requests = g_slist_reverse (queued_requests);
+  while (queued_requests && n < ICON_BATCH_SIZE)
+    {
+      icon_request *req = (icon_request *)queued_requests->data;
+
+      packages[n] = req->pi->name;
+      versions[n] = request_version (req->pi, req->installed);
+      hashes[n] = request_hash (req->pi, req->installed);
+      n++;
+
+      c->requests = g_slist_append (c->requests, req);
+      queued_requests = g_slist_delete_link (queued_requests,
+					     queued_requests);
+    }
+  packages[n] = NULL;
+  queued_requests = g_slist_reverse (queued_requests);
+
+  fetch_in_flight = true;
+  apt_worker_get_icons (packages, versions, hashes,
+			get_icons_reply, c);
+}
+
+void
+forget_missing_icons ()
+{
+  if (missing_icons)
+    g_hash_table_remove_all (missing_icons);
+}
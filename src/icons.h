@@ -0,0 +1,50 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef ICONS_H
+#define ICONS_H
+
+#include "main.h"
+
+/* The package list only contains the hashes of the icons of the
+   packages.  The icons are only decoded when they are actually shown,
+   and only a limited number of decoded icons is kept in memory.  The
+   icons are also kept in HAM_STATE_DIR/icons/ and are only requested
+   from the apt-worker when they are not found there.
+
+   PACKAGE_ICON returns the icon of the installed or available version
+   of PI, or NULL when it is not available (yet).  The returned pixbuf
+   is owned by the cache and must be referenced if it is to be kept.
+   When the icon needs to be requested from the apt-worker, PI is
+   changed, via global_package_info_changed, when it has arrived.
+*/
+
+GdkPixbuf *package_icon (package_info *pi, bool installed);
+
+/* Icons that the apt-worker could not deliver are not requested
+   again.  FORGET_MISSING_ICONS lets them be requested again, and is
+   called whenever a new package list has arrived.
+*/
+void forget_missing_icons ();
+
+#endif /* !ICONS_H */
@@ -34,6 +34,7 @@
 #include "util.h"
 #include "main.h"
 #include "settings.h"
+#include "apt-worker-client.h"
 
 #define _(x) gettext (x)
 
@@ -242,40 +243,111 @@ log_dialog_delete (GtkWidget *widget, GdkEvent *event, gpointer unused)
   return !deletable;
 }
 
-void
-show_log_dialog_flow ()
+static void
+show_log_dialog (const char *stats)
 {
-  if (start_interaction_flow ())
+  GtkWidget *dialog, *text_view;
+
+  dialog = gtk_dialog_new_with_buttons (_("ai_ti_log"),
+					NULL,
+					GTK_DIALOG_MODAL,
+					_("ai_bd_log_clear"),
+					RESPONSE_CLEAR,
+					_("ai_bd_log_save_as"),
+					RESPONSE_SAVE,
+					NULL);
+  push_dialog (dialog);
+  respond_on_escape (GTK_DIALOG (dialog), GTK_RESPONSE_CLOSE);
+
+  gtk_dialog_set_has_separator (GTK_DIALOG (dialog), FALSE);
+
+  if (stats)
     {
-      GtkWidget *dialog, *text_view;
+      char *text = g_strconcat (log_text? log_text->str : "", stats, NULL);
+      text_view = make_small_text_view (text);
+      g_free (text);
+    }
+  else
+    text_view = make_small_text_view (log_text? log_text->str : "");
+
+  gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), text_view);
+
+  gtk_widget_set_size_request (dialog, 600,300);
 
-      dialog = gtk_dialog_new_with_buttons (_("ai_ti_log"),
-					    NULL,
-					    GTK_DIALOG_MODAL,
-					    _("ai_bd_log_clear"),
-					    RESPONSE_CLEAR,
-					    _("ai_bd_log_save_as"),
-					    RESPONSE_SAVE,
-					    NULL);
-      push_dialog (dialog);
-      respond_on_escape (GTK_DIALOG (dialog), GTK_RESPONSE_CLOSE);
+  g_object_set (G_OBJECT (dialog), "deletable", TRUE, NULL);
+
+  g_signal_connect (dialog, "delete-event",
+		    G_CALLBACK (log_dialog_delete), NULL);
+  g_signal_connect (dialog, "response",
+		    G_CALLBACK (log_response), text_view);
+
+  gtk_widget_show_all (dialog);
+}
 
-      gtk_dialog_set_has_separator (GTK_DIALOG (dialog), FALSE);
+/* In red pill mode, the statistics of the apt-worker are shown
+   after the log.
+*/
+static void
+log_stats_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  GString *stats;
+  const char *name;
 
-      text_view = make_small_text_view (log_text? log_text->str : "");
+  if (dec == NULL)
+    {
+      show_log_dialog (NULL);
+      return;
+    }
 
-      gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), text_view);
+  stats = g_string_new ("\n--- apt-worker statistics (ms) ---\n");
 
-      gtk_widget_set_size_request (dialog, 600,300);
+  int cache_inits = dec->decode_int ();
+  int64_t cache_init_time = dec->decode_int64 ();
+  g_string_append_printf (stats, "cache inits: %d, %lld ms\n\n",
+			  cache_inits, (long long) cache_init_time / 1000);
 
-      g_object_set (G_OBJECT (dialog), "deletable", TRUE, NULL);
+  g_string_append (stats,
+		   "command wall cpu in out records "
+		   "inits init download updates\n");
+  while ((name = dec->decode_string_in_place ()) != NULL)
+    {
+      int64_t wall = dec->decode_int64 ();
+      int64_t cpu = dec->decode_int64 ();
+      int bytes_in = dec->decode_int ();
+      int bytes_out = dec->decode_int ();
+      int records = dec->decode_int ();
+      int inits = dec->decode_int ();
+      int64_t init_time = dec->decode_int64 ();
+      int64_t download_time = dec->decode_int64 ();
+      int64_t updates_file_time = dec->decode_int64 ();
+
+      if (dec->corrupted ())
+	break;
+
+      g_string_append_printf (stats,
+			      "%s %lld %lld %d %d %d %d %lld %lld %lld\n",
+			      name,
+			      (long long) wall / 1000,
+			      (long long) cpu / 1000,
+			      bytes_in, bytes_out, records, inits,
+			      (long long) init_time / 1000,
+			      (long long) download_time / 1000,
+			      (long long) updates_file_time / 1000);
+    }
 
-      g_signal_connect (dialog, "delete-event",
-                        G_CALLBACK (log_dialog_delete), NULL);
-      g_signal_connect (dialog, "response",
-                        G_CALLBACK (log_response), text_view);
+  show_log_dialog (stats->str);
+  g_string_free (stats, TRUE);
+}
 
-      gtk_widget_show_all (dialog);
+void
+show_log_dialog_flow ()
+{
+  if (start_interaction_flow ())
+    {
+      if (red_pill_mode)
+	apt_worker_get_stats (log_stats_reply, NULL);
+      else
+	show_log_dialog (NULL);
     }
 }
 
@@ -56,6 +56,7 @@
 #include "confutils.h"
 #include "update-notifier-conf.h"
 #include "hildon-fancy-button.h"
+#include "icons.h"
 
 #define MAX_PACKAGES_NO_CATEGORIES 7
 
@@ -408,7 +409,9 @@ package_info::package_info ()
   available_pretty_name = NULL;
   installed_short_description = NULL;
   available_short_description = NULL;
+  installed_icon_hash = NULL;
   installed_icon = NULL;
+  available_icon_hash = NULL;
   available_icon = NULL;
 
   have_info = false;
@@ -424,19 +427,30 @@ package_info::package_info ()
   dependencies = NULL;
 
   model = NULL;
+
+  strings = NULL;
+}
+
+void
+package_info::free_string (char *str)
+{
+  if (strings == NULL || !strings->contains (str))
+    g_free (str);
 }
 
 package_info::~package_info ()
 {
-  g_free (name);
-  g_free (installed_version);
-  g_free (installed_section);
-  g_free (installed_pretty_name);
-  g_free (available_version);
-  g_free (available_section);
-  g_free (available_pretty_name);
-  g_free (installed_short_description);
-  g_free (available_short_description);
+  free_string (name);
+  free_string (installed_version);
+  free_string (installed_section);
+  free_string (installed_pretty_name);
+  free_string (available_version);
+  free_string (available_section);
+  free_string (available_pretty_name);
+  free_string (installed_short_description);
+  free_string (available_short_description);
+  free_string (installed_icon_hash);
+  free_string (available_icon_hash);
   if (installed_icon)
     g_object_unref (installed_icon);
   if (available_icon)
@@ -452,6 +466,8 @@ package_info::~package_info ()
       g_list_free (summary_packages[i]);
     }
   g_free (dependencies);
+  if (strings)
+    strings->unref ();
 }
 
 const char *
@@ -883,36 +899,42 @@ struct gpl_closure {
   void *data;
 };
 
+/* The strings of the package list entries are not copied when the
+   response is in a buffer that can be kept, they point into it
+   instead.
+*/
+static char *
+decode_package_string (apt_proto_decoder *dec, package_info *info)
+{
+  if (info->strings)
+    return (char *) dec->decode_string_in_place ();
+  else
+    return dec->decode_string_dup ();
+}
+
 static package_info *
 get_package_list_entry (apt_proto_decoder *dec)
 {
-  const char *installed_icon, *available_icon;
   package_info *info = new package_info;
-  
-  info->name = dec->decode_string_dup ();
+
+  info->strings = dec->get_buffer ();
+  if (info->strings)
+    info->strings->ref ();
+
+  info->name = decode_package_string (dec, info);
   info->broken = dec->decode_int ();
-  info->installed_version = dec->decode_string_dup ();
+  info->installed_version = decode_package_string (dec, info);
   info->installed_size = dec->decode_int64 ();
-  info->installed_section = dec->decode_string_dup ();
-  info->installed_pretty_name = dec->decode_string_dup ();
-  info->installed_short_description = dec->decode_string_dup ();
-  installed_icon = dec->decode_string_in_place ();
-  info->available_version = dec->decode_string_dup ();
-  info->available_section = dec->decode_string_dup ();
-  info->available_pretty_name = dec->decode_string_dup ();
-  info->available_short_description = dec->decode_string_dup ();
-  available_icon = dec->decode_string_in_place ();
+  info->installed_section = decode_package_string (dec, info);
+  info->installed_pretty_name = decode_package_string (dec, info);
+  info->installed_short_description = decode_package_string (dec, info);
+  info->installed_icon_hash = decode_package_string (dec, info);
+  info->available_version = decode_package_string (dec, info);
+  info->available_section = decode_package_string (dec, info);
+  info->available_pretty_name = decode_package_string (dec, info);
+  info->available_short_description = decode_package_string (dec, info);
+  info->available_icon_hash = decode_package_string (dec, info);
   info->flags = dec->decode_int ();
-  
-  info->installed_icon = pixbuf_from_base64 (installed_icon);
-  if (available_icon)
-    info->available_icon = pixbuf_from_base64 (available_icon);
-  else
-    {
-      info->available_icon = info->installed_icon;
-      if (info->available_icon)
-	g_object_ref (info->available_icon);
-    }
 
   return info;
 }
@@ -953,6 +975,8 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
     what_the_fock_p ();
   else
     {
+      forget_missing_icons ();
+
       section_info *all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
 
       while (!dec->at_end ())
@@ -1172,10 +1196,23 @@ gpis_loop (package_info *pi, void *data, bool unused)
 /* GET_PACKAGE_INFOS_IN_BACKGROUND
  */
 
+/* The infos are requested in batches of GPIIB_BATCH_SIZE packages
+   with a single APTCMD_GET_PACKAGE_INFOS request each.  Only one batch
+   is in flight at any time so that a new call to
+   get_package_infos_in_background takes effect quickly.
+*/
+#define GPIIB_BATCH_SIZE 16
+
+struct gpiib_closure {
+  int n_packages;
+  package_info *packages[GPIIB_BATCH_SIZE];
+};
+
 static void gpiib_trigger ();
-static void gpiib_done (package_info *pi, void *unused, bool changed);
+static void gpiib_reply (int cmd, apt_proto_decoder *dec, void *clos);
 
 static GList *gpiib_next;
+static bool gpiib_in_flight;
 
 static void
 get_package_infos_in_background (GList *packages)
@@ -1187,24 +1224,69 @@ get_package_infos_in_background (GList *packages)
 static void
 gpiib_trigger ()
 {
-  GList *n = gpiib_next;
-  if (n)
+  const char *names[GPIIB_BATCH_SIZE + 1];
+  gpiib_closure *c;
+
+  if (gpiib_in_flight)
+    return;
+
+  c = new gpiib_closure;
+  c->n_packages = 0;
+  while (gpiib_next && c->n_packages < GPIIB_BATCH_SIZE)
     {
-      package_info *pi = (package_info *)n->data;
-      gpiib_next = n->next;
-      get_package_info (pi, true,
-			gpiib_done, NULL);
+      package_info *pi = (package_info *)gpiib_next->data;
+      gpiib_next = gpiib_next->next;
+      if (!pi->have_info)
+	{
+	  pi->ref ();
+	  names[c->n_packages] = pi->name;
+	  c->packages[c->n_packages] = pi;
+	  c->n_packages++;
+	}
+    }
+  names[c->n_packages] = NULL;
+
+  if (c->n_packages == 0)
+    {
+      delete c;
+      return;
     }
+
+  gpiib_in_flight = true;
+  apt_worker_get_package_infos (names, true, gpiib_reply, c);
 }
 
 static void 
-gpiib_done (package_info *pi, void *data, bool changed)
+gpiib_reply (int cmd, apt_proto_decoder *dec, void *clos)
 {
+  gpiib_closure *c = (gpiib_closure *)clos;
+  bool changed = false;
+
+  for (int i = 0; i < c->n_packages; i++)
+    {
+      package_info *pi = c->packages[i];
+
+      pi->have_info = false;
+      if (dec)
+	{
+	  dec->decode_mem (&(pi->info), sizeof (pi->info));
+	  if (!dec->corrupted ())
+	    {
+	      pi->have_info = true;
+	      global_package_info_changed (pi);
+	    }
+	}
+      changed = true;
+      pi->unref ();
+    }
+  delete c;
+
+  gpiib_in_flight = false;
   gpiib_trigger ();
 
   /* Resort & refresh view
    * only needed when we are sorting by size */
-  if (!gpiib_next && changed &&
+  if (!gpiib_next && !gpiib_in_flight && changed &&
       (package_sort_key == SORT_BY_SIZE))
     sort_all_packages (true);
 }
@@ -60,6 +60,12 @@ struct package_info {
 
   int ref_count;
 
+  // When STRINGS is non-NULL, the string fields might point into it
+  // instead of having been allocated individually.  Use free_string
+  // to free them.
+  apt_proto_buffer *strings;
+  void free_string (char *str);
+
   char *name;
   bool broken;
   char *installed_version;
@@ -70,9 +76,15 @@ struct package_info {
   char *available_section;
   char *available_pretty_name;
   char *installed_short_description;
+  char *installed_icon_hash;
   GdkPixbuf *installed_icon;
   char *available_short_description;
+  char *available_icon_hash;   // NULL when the available version has no icon
   GdkPixbuf *available_icon;
+
+  // The icons are normally looked up lazily via their hashes, see
+  // package_icon in icons.h.  INSTALLED_ICON and AVAILABLE_ICON are
+  // only set when there is no hash, such as for a package from a file.
   int flags;
 
   bool have_info;
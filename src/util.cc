@@ -50,6 +50,7 @@
 #include "user_files.h"
 #include "update-notifier-conf.h"
 #include "package-info-cell-renderer.h"
+#include "icons.h"
 #include "confutils.h"
 
 #define _(x) gettext (x)
@@ -540,8 +541,7 @@ ask_custom (const gchar *question,
 static GtkWidget*
 get_package_icon (package_info *pi)
 {
-  GdkPixbuf* icon = pi->installed_version
-    ? pi->installed_icon : pi->available_icon;
+  GdkPixbuf* icon = package_icon (pi, pi->installed_version != NULL);
 
   if (icon == NULL)
     icon = gtk_icon_theme_load_icon (gtk_icon_theme_get_default (),
@@ -1651,12 +1651,7 @@ package_icon_func (GtkTreeViewColumn *column,
   if (pi->broken)
     icon = broken_icon;
   else
-    {
-      if (global_installed)
-        icon = pi->installed_icon;
-      else
-	icon = pi->available_icon;
-    }
+    icon = package_icon (pi, global_installed);
 
   g_object_set (cell,
                 "pixbuf", icon ? icon : default_icon,
@@ -30,13 +30,159 @@
 
 #include "xexp.h"
 
+/* Tags are interned with g_intern_string and are never freed.
+
+   Nodes that are created one by one with xexp_list_new and
+   xexp_text_new are allocated individually, together with their text.
+   Nodes that are created as part of a whole document, by xexp_read,
+   xexp_copy, etc, are allocated from a 'arena' instead, together with
+   their texts.  An arena is a chain of large blocks that is freed in
+   one go as soon as the last of its nodes is gone.  Nodes that are
+   moved from one document to another keep their arena alive.
+
+   The texts of a arena are never modified or freed individually, so
+   xexp_copy can share them instead of copying them.  The arena of the
+   copy then holds a reference to the arenas whose texts it uses.
+*/
+
 struct xexp {
-  char *tag;
+  const char *tag;
   xexp *rest;
   xexp *first;
   char *text;
+  xexp_arena *arena;
+};
+
+typedef struct xexp_arena_block xexp_arena_block;
+
+struct xexp_arena_block {
+  xexp_arena_block *next;
+  gsize size;
+  gsize used;
+};
+
+struct xexp_arena {
+  int ref_count;
+  xexp_arena_block *blocks;
+  GSList *borrowed;
 };
 
+#define XEXP_ARENA_ALIGN(n)        (((n) + 7) & ~(gsize)7)
+#define XEXP_ARENA_BLOCK_HEADER    XEXP_ARENA_ALIGN (sizeof (xexp_arena_block))
+#define XEXP_ARENA_MIN_BLOCK_SIZE  4096
+#define XEXP_ARENA_MAX_BLOCK_SIZE  65536
+
+xexp_arena *
+xexp_arena_new (void)
+{
+  xexp_arena *a = g_new0 (xexp_arena, 1);
+  a->ref_count = 1;
+  return a;
+}
+
+static void
+xexp_arena_ref (xexp_arena *a)
+{
+  a->ref_count++;
+}
+
+void
+xexp_arena_unref (xexp_arena *a)
+{
+  GSList *l;
+
+  if (a == NULL || --a->ref_count > 0)
+    return;
+
+  while (a->blocks)
+    {
+      xexp_arena_block *b = a->blocks;
+      a->blocks = b->next;
+      g_free (b);
+    }
+
+  for (l = a->borrowed; l; l = l->next)
+    xexp_arena_unref ((xexp_arena *)l->data);
+  g_slist_free (a->borrowed);
+
+  g_free (a);
+}
+
+static gpointer
+xexp_arena_alloc (xexp_arena *a, gsize size)
+{
+  xexp_arena_block *b = a->blocks;
+  gpointer p;
+
+  size = XEXP_ARENA_ALIGN (size);
+  if (b == NULL || b->used + size > b->size)
+    {
+      gsize block_size = (b? MIN (2 * b->size, XEXP_ARENA_MAX_BLOCK_SIZE)
+			  : XEXP_ARENA_MIN_BLOCK_SIZE);
+      if (block_size < XEXP_ARENA_BLOCK_HEADER + size)
+	block_size = XEXP_ARENA_BLOCK_HEADER + size;
+
+      b = g_malloc (block_size);
+      b->size = block_size;
+      b->used = XEXP_ARENA_BLOCK_HEADER;
+      b->next = a->blocks;
+      a->blocks = b;
+    }
+
+  p = (char *)b + b->used;
+  b->used += size;
+  return p;
+}
+
+static char *
+xexp_arena_strndup (xexp_arena *a, const char *str, gsize len)
+{
+  char *p = xexp_arena_alloc (a, len + 1);
+  memcpy (p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+/* Make sure that the texts of arena B stay alive as long as A.
+ */
+static void
+xexp_arena_borrow (xexp_arena *a, xexp_arena *b)
+{
+  if (a == b || g_slist_find (a->borrowed, b))
+    return;
+
+  xexp_arena_ref (b);
+  a->borrowed = g_slist_prepend (a->borrowed, b);
+}
+
+static xexp *
+xexp_node_new (xexp_arena *a, const char *tag)
+{
+  xexp *x;
+
+  if (a)
+    {
+      x = xexp_arena_alloc (a, sizeof (xexp));
+      memset (x, 0, sizeof (xexp));
+      xexp_arena_ref (a);
+      x->arena = a;
+    }
+  else
+    x = g_slice_new0 (xexp);
+
+  x->tag = g_intern_string (tag);
+  return x;
+}
+
+static void
+xexp_set_text (xexp *x, const char *text, gsize len)
+{
+  if (x->arena)
+    x->text = xexp_arena_strndup (x->arena, text, len);
+  else
+    x->text = g_strndup (text, len);
+}
+
 xexp *
 xexp_rest (xexp *x)
 {
@@ -61,27 +207,53 @@ xexp_free (xexp *x)
       xexp_free (c);
       c = r;
     }
-  g_free (x->tag);
-  g_free (x->text);
-  g_free (x);
+
+  if (x->arena)
+    xexp_arena_unref (x->arena);
+  else
+    {
+      g_free (x->text);
+      g_slice_free (xexp, x);
+    }
 }
 
-xexp *
-xexp_copy (xexp *x)
+static xexp *
+xexp_copy_1 (xexp_arena *a, xexp *x)
 {
   xexp *y, *z, **zptr;
 
-  if (x == NULL)
-    return NULL;
+  y = xexp_node_new (a, x->tag);
+  if (x->text)
+    {
+      if (x->arena)
+	{
+	  xexp_arena_borrow (a, x->arena);
+	  y->text = x->text;
+	}
+      else
+	xexp_set_text (y, x->text, strlen (x->text));
+    }
 
-  y = g_new0 (xexp, 1);
-  y->tag = g_strdup (x->tag);
-  y->text = g_strdup (x->text);
-  
   for (z = x->first, zptr = &y->first;
        z;
        z = z->rest, zptr = &(*zptr)->rest)
-    *zptr = xexp_copy (z);
+    *zptr = xexp_copy_1 (a, z);
+
+  return y;
+}
+
+xexp *
+xexp_copy (xexp *x)
+{
+  xexp_arena *a;
+  xexp *y;
+
+  if (x == NULL)
+    return NULL;
+
+  a = xexp_arena_new ();
+  y = xexp_copy_1 (a, x);
+  xexp_arena_unref (a);
 
   return y;
 }
@@ -95,7 +267,7 @@ xexp_tag (xexp *x)
 int
 xexp_is (xexp *x, const char *tag)
 {
-  return strcmp (x->tag, tag) == 0;
+  return x->tag == tag || strcmp (x->tag, tag) == 0;
 }
 
 int
@@ -106,12 +278,16 @@ xexp_is_empty (xexp *x)
 
 xexp *
 xexp_list_new (const char *tag)
+{
+  return xexp_arena_list_new (NULL, tag);
+}
+
+xexp *
+xexp_arena_list_new (xexp_arena *a, const char *tag)
 {
   g_assert (tag);
 
-  xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
-  return x;
+  return xexp_node_new (a, tag);
 }
 
 xexp *
@@ -367,27 +543,31 @@ xexp_pop (xexp *x)
 
 xexp *
 xexp_text_new (const char *tag, const char *text)
+{
+  return xexp_arena_text_new (NULL, tag, text);
+}
+
+xexp *
+xexp_text_newn (const char *tag, const char *text, int len)
 {
   g_assert (tag);
   g_assert (text);
 
-  xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
+  xexp *x = xexp_node_new (NULL, tag);
   if (*text)
-    x->text = g_strdup (text);
+    x->text = g_strndup (text, len);
   return x;
 }
 
 xexp *
-xexp_text_newn (const char *tag, const char *text, int len)
+xexp_arena_text_new (xexp_arena *a, const char *tag, const char *text)
 {
   g_assert (tag);
   g_assert (text);
 
-  xexp *x = g_new0 (xexp, 1);
-  x->tag = g_strdup (tag);
+  xexp *x = xexp_node_new (a, tag);
   if (*text)
-    x->text = g_strndup (text, len);
+    xexp_set_text (x, text, strlen (text));
   return x;
 }
 
@@ -530,7 +710,8 @@ xexp_adel (xexp *x, const char *tag)
 static void
 transmogrify_text_to_empty (xexp *x)
 {
-  g_free (x->text);
+  if (x->arena == NULL)
+    g_free (x->text);
   x->text = NULL;
 }
 
@@ -538,12 +719,13 @@ static void
 transmogrify_empty_to_text (xexp *x, const char *text)
 {
   g_assert (text && *text);
-  x->text = g_strdup (text);
+  xexp_set_text (x, text, strlen (text));
 }
 
 /** Parsing */
 
 typedef struct {
+  xexp_arena *arena;
   xexp *result;
   GSList *stack;
 } xexp_parse_context;
@@ -572,7 +754,7 @@ xexp_parser_start_element (GMarkupParseContext *context,
 {
   xexp_parse_context *xp = (xexp_parse_context *)user_data;
 
-  xexp *x = xexp_list_new (element_name);
+  xexp *x = xexp_arena_list_new (xp->arena, element_name);
   if (xp->stack)
     {
       /* If the current node is a text, it must be all whitespace and
@@ -642,36 +824,26 @@ static GMarkupParser xexp_markup_parser = {
   NULL
 };
 
+/* Parse the xexp in the LEN bytes at BUF with the glib XML parser.
+ */
 static xexp *
-xexp_read_1 (FILE *f, GError **error, int fuzzy)
+xexp_read_markup (const char *buf, gsize len, GError **error)
 {
   xexp_parse_context xp;
   GMarkupParseContext *ctxt;
-  gchar buf[1024];
-  size_t buf_size = fuzzy? sizeof (buf) : 1;
-  size_t n;
   gboolean parse_failed = FALSE;
 
-  if (f == NULL)
-    return NULL;
-
+  xp.arena = xexp_arena_new ();
   xp.stack = NULL;
   xp.result = NULL;
   ctxt = g_markup_parse_context_new (&xexp_markup_parser, 0, &xp, NULL);
 
-  while (xp.result == NULL && (n = fread (buf, 1, buf_size, f)) > 0)
-    {
-      if (!g_markup_parse_context_parse (ctxt, buf, n, error))
-	{
-	  parse_failed = TRUE;
-	  break;
-	}
-    }
-
-  if (!g_markup_parse_context_end_parse (ctxt, error))
+  if (!g_markup_parse_context_parse (ctxt, buf, len, error)
+      || !g_markup_parse_context_end_parse (ctxt, error))
     parse_failed = TRUE;
 
   g_markup_parse_context_free (ctxt);
+  xexp_arena_unref (xp.arena);
 
   if (!parse_failed)
     {
@@ -692,33 +864,398 @@ xexp_read_1 (FILE *f, GError **error, int fuzzy)
   return NULL;
 }
 
+/* The pull parser.
+
+   Files written by xexp_write use only a small part of XML: elements
+   without attributes, text with the five predefined entities and
+   character references, white space, and maybe a <?xml ...?>
+   declaration at the start.  The pull parser handles exactly that,
+   directly from a buffer and without any callbacks.
+
+   When it finds anything else, or something wrong, it gives up and
+   the glib XML parser is used instead, which either knows what to do
+   or produces a good error message.  The pull parser does not check
+   that the text is valid UTF-8, so it is only used for buffers that
+   have been checked, see xexp_read_buffer.
+*/
+
+#define XEXP_PULL_MAX_TAG    128
+#define XEXP_PULL_MAX_DEPTH  256
+
+typedef struct {
+  const char *p, *end;
+  xexp_arena *arena;
+  GString *scratch;
+} xexp_pull_parser;
+
+static int
+xexp_pull_is_name_char (char c)
+{
+  return (isalnum ((unsigned char)c)
+	  || c == '-' || c == '_' || c == ':' || c == '.');
+}
+
+static void
+xexp_pull_skip_space (xexp_pull_parser *pp)
+{
+  while (pp->p < pp->end && isspace ((unsigned char)*pp->p))
+    pp->p++;
+}
+
+/* Read a tag name into BUF, which has room for XEXP_PULL_MAX_TAG
+   bytes.
+*/
+static int
+xexp_pull_name (xexp_pull_parser *pp, char *buf)
+{
+  const char *start = pp->p;
+
+  while (pp->p < pp->end && xexp_pull_is_name_char (*pp->p))
+    pp->p++;
+
+  if (pp->p == start || pp->p - start >= XEXP_PULL_MAX_TAG)
+    return FALSE;
+
+  memcpy (buf, start, pp->p - start);
+  buf[pp->p - start] = '\0';
+  return TRUE;
+}
+
+/* Decode the LEN bytes of text at TEXT into PP->scratch.
+ */
+static int
+xexp_pull_unescape (xexp_pull_parser *pp, const char *text, gsize len)
+{
+  const char *end = text + len;
+
+  g_string_truncate (pp->scratch, 0);
+  while (text < end)
+    {
+      const char *amp = memchr (text, '&', end - text);
+      const char *semi;
+
+      if (amp == NULL)
+	{
+	  g_string_append_len (pp->scratch, text, end - text);
+	  break;
+	}
+
+      g_string_append_len (pp->scratch, text, amp - text);
+      semi = memchr (amp, ';', end - amp);
+      if (semi == NULL)
+	return FALSE;
+
+      if (semi - amp == 3 && !strncmp (amp, "&lt;", 4))
+	g_string_append_c (pp->scratch, '<');
+      else if (semi - amp == 3 && !strncmp (amp, "&gt;", 4))
+	g_string_append_c (pp->scratch, '>');
+      else if (semi - amp == 4 && !strncmp (amp, "&amp;", 5))
+	g_string_append_c (pp->scratch, '&');
+      else if (semi - amp == 5 && !strncmp (amp, "&quot;", 6))
+	g_string_append_c (pp->scratch, '"');
+      else if (semi - amp == 5 && !strncmp (amp, "&apos;", 6))
+	g_string_append_c (pp->scratch, '\'');
+      else if (semi - amp > 2 && amp[1] == '#')
+	{
+	  char *num_end;
+	  gulong c;
+
+	  if (amp[2] == 'x')
+	    c = strtoul (amp + 3, &num_end, 16);
+	  else
+	    c = strtoul (amp + 2, &num_end, 10);
+
+	  if (num_end != semi || c == 0 || !g_unichar_validate (c))
+	    return FALSE;
+	  g_string_append_unichar (pp->scratch, c);
+	}
+      else
+	return FALSE;
+
+      text = semi + 1;
+    }
+
+  return TRUE;
+}
+
+/* Parse one element, starting at its '<'.  Returns NULL when the
+   element can not be handled.
+*/
+static xexp *
+xexp_pull_element (xexp_pull_parser *pp, int depth)
+{
+  char tag[XEXP_PULL_MAX_TAG], end_tag[XEXP_PULL_MAX_TAG];
+  xexp *x, **tail;
+  int has_children = FALSE;
+
+  if (depth > XEXP_PULL_MAX_DEPTH)
+    return NULL;
+
+  pp->p++;
+  if (!xexp_pull_name (pp, tag))
+    return NULL;
+  xexp_pull_skip_space (pp);
+
+  x = xexp_arena_list_new (pp->arena, tag);
+  tail = &x->first;
+
+  if (pp->end - pp->p >= 2 && pp->p[0] == '/' && pp->p[1] == '>')
+    {
+      pp->p += 2;
+      return x;
+    }
+  if (pp->p >= pp->end || *pp->p != '>')
+    goto fail;
+  pp->p++;
+
+  while (1)
+    {
+      const char *text = pp->p;
+      int has_space_only = TRUE, has_entities = FALSE;
+
+      while (pp->p < pp->end && *pp->p != '<')
+	{
+	  if (!isspace ((unsigned char)*pp->p))
+	    has_space_only = FALSE;
+	  if (*pp->p == '&')
+	    has_entities = TRUE;
+	  pp->p++;
+	}
+
+      if (pp->end - pp->p < 2)
+	goto fail;
+
+      if (pp->p[1] == '/')
+	{
+	  gsize text_len = pp->p - text;
+
+	  pp->p += 2;
+	  if (!xexp_pull_name (pp, end_tag)
+	      || strcmp (tag, end_tag))
+	    goto fail;
+	  xexp_pull_skip_space (pp);
+	  if (pp->p >= pp->end || *pp->p != '>')
+	    goto fail;
+	  pp->p++;
+
+	  if (has_children)
+	    {
+	      if (!has_space_only)
+		goto fail;
+	    }
+	  else if (text_len > 0)
+	    {
+	      if (!has_entities)
+		xexp_set_text (x, text, text_len);
+	      else
+		{
+		  if (!xexp_pull_unescape (pp, text, text_len))
+		    goto fail;
+		  if (pp->scratch->len > 0)
+		    xexp_set_text (x, pp->scratch->str, pp->scratch->len);
+		}
+	    }
+
+	  return x;
+	}
+      else if (pp->p[1] == '!' || pp->p[1] == '?' || !has_space_only)
+	goto fail;
+      else
+	{
+	  xexp *y = xexp_pull_element (pp, depth + 1);
+	  if (y == NULL)
+	    goto fail;
+	  *tail = y;
+	  tail = &y->rest;
+	  has_children = TRUE;
+	}
+    }
+
+ fail:
+  xexp_free (x);
+  return NULL;
+}
+
+/* Parse the first xexp in the LEN bytes at BUF.  Returns NULL when
+   the pull parser can not handle it.
+*/
+static xexp *
+xexp_pull (const char *buf, gsize len)
+{
+  xexp_pull_parser pp;
+  xexp *x = NULL;
+
+  pp.p = buf;
+  pp.end = buf + len;
+
+  /* Skip a UTF-8 byte order mark and the XML declaration.
+   */
+  if (len >= 3 && !memcmp (pp.p, "\xef\xbb\xbf", 3))
+    pp.p += 3;
+  xexp_pull_skip_space (&pp);
+  if (pp.end - pp.p >= 2 && !memcmp (pp.p, "<?", 2))
+    {
+      const char *decl_end = g_strstr_len (pp.p, pp.end - pp.p, "?>");
+      if (decl_end == NULL)
+	return NULL;
+      pp.p = decl_end + 2;
+      xexp_pull_skip_space (&pp);
+    }
+
+  if (pp.p >= pp.end || *pp.p != '<')
+    return NULL;
+
+  pp.arena = xexp_arena_new ();
+  pp.scratch = g_string_new ("");
+  x = xexp_pull_element (&pp, 0);
+  g_string_free (pp.scratch, TRUE);
+  xexp_arena_unref (pp.arena);
+
+  return x;
+}
+
+/* The glib XML parser rejects invalid UTF-8, and so must we: the
+   text ends up in the protocol and in GTK labels.
+*/
+static xexp *
+xexp_read_buffer (const char *buf, gsize len, GError **error)
+{
+  if (g_utf8_validate (buf, len, NULL))
+    {
+      xexp *x = xexp_pull (buf, len);
+      if (x)
+	return x;
+    }
+  return xexp_read_markup (buf, len, error);
+}
+
+/* Read the bytes of exactly one element from F, without reading
+   anything after it.  The standard I/O buffer of F takes care of
+   reading F in large chunks.
+*/
+static GString *
+xexp_read_element_bytes (FILE *f)
+{
+  GString *buf = g_string_new ("");
+  int depth = 0, seen_element = FALSE;
+  int c;
+
+  while ((c = getc (f)) != EOF)
+    {
+      g_string_append_c (buf, c);
+      if (c != '<')
+	continue;
+
+      c = getc (f);
+      if (c == EOF)
+	break;
+      g_string_append_c (buf, c);
+
+      if (c == '!' || c == '?')
+	{
+	  /* A comment, declaration, or processing instruction.  These
+	     don't nest; a comment ends with "-->", the others with
+	     ">".
+	  */
+	  int is_comment = FALSE, last = 0, before_last = 0;
+
+	  if (c == '!')
+	    {
+	      c = getc (f);
+	      if (c == EOF)
+		break;
+	      g_string_append_c (buf, c);
+	      is_comment = (c == '-');
+	    }
+
+	  while ((c = getc (f)) != EOF)
+	    {
+	      g_string_append_c (buf, c);
+	      if (c == '>'
+		  && (!is_comment || (last == '-' && before_last == '-')))
+		break;
+	      before_last = last;
+	      last = c;
+	    }
+	}
+      else
+	{
+	  int closing = (c == '/'), last = c, quote = 0;
+
+	  while ((c = getc (f)) != EOF)
+	    {
+	      g_string_append_c (buf, c);
+	      if (quote)
+		{
+		  if (c == quote)
+		    quote = 0;
+		}
+	      else if (c == '"' || c == '\'')
+		quote = c;
+	      else if (c == '>')
+		break;
+	      last = c;
+	    }
+
+	  if (closing)
+	    depth--;
+	  else if (last != '/')
+	    depth++;
+	  seen_element = TRUE;
+
+	  if (depth <= 0)
+	    break;
+	}
+
+      if (c == EOF)
+	break;
+      if (seen_element && depth <= 0)
+	break;
+    }
+
+  return buf;
+}
+
 xexp *
 xexp_read (FILE *f, GError **error)
 {
+  GString *buf;
+  xexp *x;
+
   if (f == NULL)
     return NULL;
-  else
-    return xexp_read_1 (f, error, FALSE);
+
+  buf = xexp_read_element_bytes (f);
+  x = xexp_read_buffer (buf->str, buf->len, error);
+  g_string_free (buf, TRUE);
+
+  return x;
 }
 
 xexp *
 xexp_read_file (const char *filename)
 {
-  FILE *f = fopen (filename, "r");
-  if (f != NULL)
+  GError *error = NULL;
+  gchar *contents;
+  gsize len;
+  xexp *x;
+
+  if (!g_file_get_contents (filename, &contents, &len, &error))
     {
-      GError *error = NULL;
-      xexp *x = xexp_read_1 (f, &error, TRUE);
-      fclose (f);
-      if (error)
-	{
-	  fprintf (stderr, "%s: %s\n", filename, error->message);
-	  g_error_free (error);
-	}
-      return x;
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return NULL;
     }
-  fprintf (stderr, "%s: %s\n", filename, strerror (errno));
-  return NULL;
+
+  x = xexp_read_buffer (contents, len, &error);
+  g_free (contents);
+
+  if (error)
+    {
+      fprintf (stderr, "%s: %s\n", filename, error->message);
+      g_error_free (error);
+    }
+  return x;
 }
 
 /** Writing */
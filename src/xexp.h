@@ -82,6 +82,12 @@
    xexp.  (Yes, I can see already that I will add reference counting
    eventually, and then a tracing GC...)
 
+   Internally, the nodes of whole documents, such as those made by
+   xexp_read and xexp_copy, are allocated together from a 'arena' that
+   is freed as a whole, and texts are shared between a xexp and its
+   copies.  This is invisible to the user of xexps, except for the
+   functions in the ARENAS section below.
+
    The following reference states the pre-conditions for some
    functions.  When these conditions are not fulfilled, the
    implementation will generally emit a warning and then do something
@@ -117,7 +123,8 @@
 
    Return a deep-copy of X.  You should eventually put the result into
    another xexp or free it with xexp_free.  The result is a free
-   standing xexp.
+   standing xexp.  The nodes of the copy are allocated from a new
+   arena, but the texts of X are shared with it where possible.
 
    - xexpr *xexp_free (xexp *X)
 
@@ -305,6 +312,29 @@
    Write X to the file named FILENAME.  When the file can not be
    written, the error is logged to stderr, the old version of it is
    left in place and false is returned.  Otherwise, true is returned.
+
+
+   ARENAS
+
+   Code that builds a large document node by node can allocate its
+   nodes from a arena to make creating and freeing it cheaper.  The
+   resulting xexps are used exactly like all others.
+
+   - xexp_arena *xexp_arena_new ()
+
+   Create a new arena.  The caller holds a reference to it.
+
+   - void xexp_arena_unref (xexp_arena *A)
+
+   Give up the reference to A.  A is freed when all xexps allocated
+   from it have been freed as well.
+
+   - xexp *xexp_arena_list_new (xexp_arena *A, const char *TAG)
+   - xexp *xexp_arena_text_new (xexp_arena *A, const char *TAG,
+                                const char *TEXT)
+
+   Like xexp_list_new and xexp_text_new, but allocate the new xexp
+   from A.  When A is NULL, the xexp is allocated individually.
 */
 
 #ifndef XEXP_H
@@ -316,6 +346,9 @@
 struct xexp;
 typedef struct xexp xexp;
 
+struct xexp_arena;
+typedef struct xexp_arena xexp_arena;
+
 /* General
  */
 const char *xexp_tag (xexp *x);
@@ -370,4 +403,11 @@ void xexp_write (FILE *f, xexp *x);
 xexp *xexp_read_file (const char *filename);
 int xexp_write_file (const char *filename, xexp *x);
 
+/* Arenas
+ */
+xexp_arena *xexp_arena_new (void);
+void xexp_arena_unref (xexp_arena *a);
+xexp *xexp_arena_list_new (xexp_arena *a, const char *tag);
+xexp *xexp_arena_text_new (xexp_arena *a, const char *tag, const char *text);
+
 #endif